@@ -0,0 +1,489 @@
+#include "nn.hpp"
+#include "datasetCache.hpp"
+#include "kernels.hpp"
+#include "staticNet.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+// Micro- and macro-benchmarks on synthetic data. Every result is printed as
+// one JSON object per line:
+//   {"name": ..., "iterations": ..., "ns_per_op": ..., "gb_per_s": ..., "images_per_s": ...}
+// gb_per_s counts every operand of an op once; images_per_s is only present
+// for ops that process images.
+
+struct BenchConfig {
+    std::size_t pixels = 256 * 256;
+    std::size_t hidden = 256;
+    std::size_t images = 256;
+    std::size_t batch_size = 16;
+    float density = 0.013f;     // share of set pixels, ~ the drawings in data/
+    std::size_t threads = 0;
+    double min_time = 0.5;      // seconds spent timing each benchmark
+    WeightFormat format = WeightFormat::Float32;
+    UpdateRule optimizer = UpdateRule::Sgd;
+    std::string filter;
+};
+
+static void usage() {
+    std::cerr
+        << "Usage: classifier_bench [options]\n"
+        << "  --pixels N       input size (default 65536)\n"
+        << "  --hidden N       first hidden layer size (default 256)\n"
+        << "  --images N       synthetic dataset size (default 256)\n"
+        << "  --batch N        batch size (default 16)\n"
+        << "  --density F      share of set pixels (default 0.013)\n"
+        << "  --threads N      0 = one per core (default 0)\n"
+        << "  --min-time S     seconds per benchmark (default 0.5)\n"
+        << "  --format F       weight storage: fp32, bf16 or fp16 (default fp32)\n"
+        << "  --optimizer O    sgd, momentum, nesterov or adam (default sgd)\n"
+        << "  --filter TEXT    only run benchmarks whose name contains TEXT\n";
+}
+
+static BenchConfig parse_args(int argc, char** argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        auto option = std::string(argv[i]);
+        if (option == "--help") {
+            usage();
+            exit(0);
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << '\n';
+            usage();
+            exit(1);
+        }
+        auto value = std::string(argv[++i]);
+        if (option == "--pixels") config.pixels = std::stoul(value);
+        else if (option == "--hidden") config.hidden = std::stoul(value);
+        else if (option == "--images") config.images = std::stoul(value);
+        else if (option == "--batch") config.batch_size = std::stoul(value);
+        else if (option == "--density") config.density = std::stof(value);
+        else if (option == "--threads") config.threads = std::stoul(value);
+        else if (option == "--min-time") config.min_time = std::stod(value);
+        else if (option == "--filter") config.filter = value;
+        else if (option == "--format") {
+            if (value == "fp32") config.format = WeightFormat::Float32;
+            else if (value == "bf16") config.format = WeightFormat::BFloat16;
+            else if (value == "fp16") config.format = WeightFormat::Float16;
+            else {
+                std::cerr << "Unknown weight format: " << value << '\n';
+                exit(1);
+            }
+        } else if (option == "--optimizer") {
+            if (value == "sgd") config.optimizer = UpdateRule::Sgd;
+            else if (value == "momentum") config.optimizer = UpdateRule::Momentum;
+            else if (value == "nesterov") config.optimizer = UpdateRule::Nesterov;
+            else if (value == "adam") config.optimizer = UpdateRule::Adam;
+            else {
+                std::cerr << "Unknown optimizer: " << value << '\n';
+                exit(1);
+            }
+        } else {
+            std::cerr << "Unknown option: " << option << '\n';
+            usage();
+            exit(1);
+        }
+    }
+    if (config.images < config.batch_size || config.batch_size == 0) {
+        std::cerr << "Need at least one full batch of images\n";
+        exit(1);
+    }
+    return config;
+}
+
+// Library code reports progress on std::cout, which would break the output format.
+class QuietStdout {
+public:
+    QuietStdout(): saved_(std::cout.rdbuf(nullptr)) {}
+    ~QuietStdout() { std::cout.rdbuf(saved_); }
+
+private:
+    std::streambuf* saved_;
+};
+
+struct OpCost {
+    double bytes = 0;
+    double images = 0;
+};
+
+class Bench {
+public:
+    explicit Bench(BenchConfig const& config): config_(config) {}
+
+    // Runs `op` (warm-up call first) with growing repeat counts until one
+    // round takes min_time; `ops_per_call` is for calls that do several ops.
+    void run(std::string const& name, OpCost cost, std::function<void()> const& op, std::size_t ops_per_call = 1) {
+        if (name.find(config_.filter) == std::string::npos) return;
+        using Clock = std::chrono::steady_clock;
+        {
+            QuietStdout quiet;
+            op();
+        }
+
+        std::size_t calls = 1;
+        double seconds = 0;
+        while (true) {
+            QuietStdout quiet;
+            auto start = Clock::now();
+            for (std::size_t c = 0; c < calls; c++) {
+                op();
+            }
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            if (seconds >= config_.min_time || calls >= (std::size_t(1) << 30)) break;
+            auto scale = seconds > 0 ? config_.min_time / seconds * 1.2 : 100.0;
+            calls = static_cast<std::size_t>(calls * std::min(100.0, std::max(2.0, scale)));
+        }
+
+        auto ops = static_cast<double>(calls * ops_per_call);
+        auto ns_per_op = seconds * 1e9 / ops;
+        std::printf("{\"name\": \"%s\", \"iterations\": %.0f, \"ns_per_op\": %.1f", name.c_str(), ops, ns_per_op);
+        if (cost.bytes > 0) std::printf(", \"gb_per_s\": %.3f", cost.bytes / ns_per_op);
+        if (cost.images > 0) std::printf(", \"images_per_s\": %.1f", cost.images * 1e9 / ns_per_op);
+        std::printf("}\n");
+        std::fflush(stdout);
+    }
+
+private:
+    BenchConfig config_;
+};
+
+static char const* const CLASS_NAMES[] = {"bee", "carrot", "key"};
+
+static Dataset make_dataset(BenchConfig const& config, std::mt19937& gen) {
+    auto pixel = std::bernoulli_distribution(config.density);
+    Dataset result;
+    std::vector<float> pixels(config.pixels);
+    for (std::size_t r = 0; r < config.images; r++) {
+        for (auto& value: pixels) {
+            value = pixel(gen) ? 1.0f : 0.0f;
+        }
+        result.push_back({CLASS_NAMES[r % 3], PackedImage::from_floats(pixels)});
+    }
+    return result;
+}
+
+static NeuralNet::Config make_config(BenchConfig const& config) {
+    return NeuralNet::Config {
+        {CLASS_NAMES[0], CLASS_NAMES[1], CLASS_NAMES[2]},
+        {
+            {config.pixels, config.hidden},
+            {config.hidden, 128},
+            {128, 3},
+        },
+        {ReLu, ReLu, sigm},
+        {ReLu_derivative, ReLu_derivative, sigm_derivative},
+        MSE,
+        config.format,
+    };
+}
+
+static std::string csv_line(Record const& record) {
+    std::string line = record.name;
+    for (float value: record.image.to_floats()) {
+        line += value > 0 ? ",1" : ",0";
+    }
+    return line;
+}
+
+static std::size_t weight_bytes(Layer const& layer) {
+    auto size = layer.get_weight_format() == WeightFormat::Float32 ? sizeof(float) : sizeof(std::uint16_t);
+    return layer.get_in_size() * layer.get_out_size() * size;
+}
+
+static kernels::UpdateParams update_params(BenchConfig const& config) {
+    return {config.optimizer, 1e-9f, 0.9f, 0.999f, 1e-8f};
+}
+
+// fp32 arrays streamed by one update: gradient read, weights and every
+// state buffer read and written.
+static double update_sweeps(BenchConfig const& config) {
+    switch (config.optimizer) {
+        case UpdateRule::Sgd: return 3;
+        case UpdateRule::Adam: return 7;
+        default: return 5;
+    }
+}
+
+static void bench_layer(Bench& bench, BenchConfig const& config, Dataset const& data) {
+    auto layer = Layer(config.pixels, config.hidden, ReLu, ReLu_derivative);
+    layer.set_weight_format(config.format);
+    auto batch_size = config.batch_size;
+    auto weights = static_cast<double>(weight_bytes(layer));
+
+    Batch dense, sparse;
+    fill_batch(dense, data, 0, batch_size, false);
+    fill_batch(sparse, data, 0, batch_size, true);
+    auto image = data[0].image.to_floats();
+    auto active = static_cast<double>(sparse.active.indices.size());
+    auto gathered = active * config.hidden * weights / (config.pixels * config.hidden);
+    auto dense_input = static_cast<double>(batch_size * config.pixels * sizeof(float));
+
+    auto single = std::vector<float>(layer.get_out_size());
+    Matrix sums, values;
+    bench.run("layer/sum_inputs/image", {weights + config.pixels * sizeof(float), 1}, [&] {
+        layer.sum_inputs(image.data(), single.data());
+    });
+    bench.run("layer/sum_inputs/dense", {weights + dense_input, double(batch_size)}, [&] {
+        layer.sum_inputs(dense.images, sums);
+    });
+    bench.run("layer/sum_inputs/sparse", {gathered, double(batch_size)}, [&] {
+        layer.sum_inputs(sparse.active, sums);
+    });
+    bench.run("layer/forward_pass/dense", {weights + dense_input, double(batch_size)}, [&] {
+        layer.forward_pass(dense.images, sums, values);
+    });
+    bench.run("layer/forward_pass/sparse", {gathered, double(batch_size)}, [&] {
+        layer.forward_pass(sparse.active, sums, values);
+    });
+
+    // The activation alone over a hidden-sized output; repeated in place it
+    // settles at a fixed point, which does not change the cost.
+    auto activations = Matrix(batch_size, config.hidden);
+    activations.fill(0.5f);
+    auto activation_bytes = static_cast<double>(2 * batch_size * config.hidden * sizeof(float));
+    bench.run("layer/activation/sigm", {activation_bytes, double(batch_size)}, [&] {
+        for (std::size_t b = 0; b < batch_size; b++) SigmoidActivation::apply(activations.row(b), config.hidden);
+    });
+    bench.run("layer/activation/fast_sigm", {activation_bytes, double(batch_size)}, [&] {
+        for (std::size_t b = 0; b < batch_size; b++) FastSigmoidActivation::apply(activations.row(b), config.hidden);
+    });
+
+    // Tiny rates keep the weights in range however often the update repeats.
+    auto params = update_params(config);
+    layer.set_update_rule(config.optimizer);
+    auto master = static_cast<double>(config.pixels * config.hidden * sizeof(float)) * update_sweeps(config);
+    auto half_writes = config.format == WeightFormat::Float32 ? 0.0 : weights;
+    auto gradient = layer.make_gradient();
+    layer.reset_gradient(gradient, nullptr);
+    gradient.weights.fill(1.0f);
+    bench.run("layer/update_gradient/dense", {master + half_writes}, [&] {
+        layer.update_gradient(gradient, params);
+    });
+
+    ActiveColumns columns;
+    if (collect_active_columns(columns, data, 0, batch_size)) {
+        auto sparse_gradient = layer.make_gradient();
+        layer.reset_gradient(sparse_gradient, &columns);
+        sparse_gradient.weights.fill(1.0f);
+        auto touched = static_cast<double>(columns.columns.size() * config.hidden);
+        auto half_touched = config.format == WeightFormat::Float32 ? 0.0 : touched * sizeof(std::uint16_t);
+        // Rules with state sweep the whole layer; only the gradient stays sparse.
+        auto sparse_bytes = config.optimizer == UpdateRule::Sgd
+            ? touched * 3 * sizeof(float) + half_touched
+            : master / update_sweeps(config) * (update_sweeps(config) - 1) + touched * sizeof(float) + half_writes;
+        bench.run("layer/update_gradient/sparse", {sparse_bytes}, [&] {
+            layer.update_gradient(sparse_gradient, params);
+        });
+    }
+}
+
+static void bench_net(Bench& bench, BenchConfig const& config, Dataset const& data) {
+    auto net_config = make_config(config);
+    auto pool = ThreadPool(config.threads);
+
+    // The work of NeuralNet::update_weigths: every layer of the same shapes
+    // takes a dense gradient step, rows split across the pool.
+    std::vector<Layer> layers;
+    for (std::size_t l = 0; l < net_config.layers_sizes.size(); l++) {
+        auto [in_size, out_size] = net_config.layers_sizes[l];
+        layers.emplace_back(in_size, out_size, net_config.functions[l], net_config.derivatives[l]);
+        layers.back().set_weight_format(config.format);
+        layers.back().set_update_rule(config.optimizer);
+    }
+    auto params = update_params(config);
+    std::vector<LayerGradient> gradients;
+    double update_bytes = 0;
+    for (auto const& layer: layers) {
+        gradients.push_back(layer.make_gradient());
+        layer.reset_gradient(gradients.back(), nullptr);
+        gradients.back().weights.fill(1.0f);
+        auto master = static_cast<double>(layer.get_in_size() * layer.get_out_size() * sizeof(float));
+        update_bytes += update_sweeps(config) * master + (layer.get_weight_format() == WeightFormat::Float32 ? 0.0 : weight_bytes(layer));
+    }
+    bench.run("net/update_weights", {update_bytes}, [&] {
+        auto chunks = pool.size();
+        pool.parallel_for(chunks, [&](std::size_t chunk) {
+            for (std::size_t l = 0; l < layers.size(); l++) {
+                auto rows = layers[l].get_out_size();
+                layers[l].update_gradient(gradients[l], params, rows * chunk / chunks, rows * (chunk + 1) / chunks);
+            }
+        });
+    });
+
+    auto net = NeuralNet(net_config);
+    static constexpr std::size_t STEPS = 8;
+    auto train = NeuralNet::TrainConfig{STEPS - 1, 1e-4f, config.batch_size, config.threads, {config.optimizer}};
+    bench.run("net/train_step", {0, double(config.batch_size)}, [&] {
+        net.learn(data, train);
+    }, STEPS);
+
+    bench.run("net/predict", {0, double(data.size())}, [&] {
+        net.predict(data, pool);
+    });
+
+    // Column-major inference copy with compile-time activations.
+    using PolicyNet = StaticNet<StaticLayer<ReLuActivation>, StaticLayer<ReLuActivation>, StaticLayer<SigmoidActivation>>;
+    auto policy_net = PolicyNet(net);
+    bench.run("net/predict_static", {0, double(data.size())}, [&] {
+        policy_net.predict(data, pool);
+    });
+
+    // Convolution and pooling in front of the same dense layers; they need square images.
+    auto side = static_cast<std::size_t>(std::lround(std::sqrt(static_cast<double>(config.pixels))));
+    if (side * side == config.pixels && side >= 32) {
+        auto conv_config = net_config;
+        conv_config.features = {
+            {LayerKind::Conv2D, 8, 5, 2, 2},
+            {LayerKind::MaxPool2D, 0, 4, 4},
+            {LayerKind::Conv2D, 16, 3, 1, 1},
+            {LayerKind::MaxPool2D, 0, 4, 4},
+        };
+        auto conv_net = NeuralNet(conv_config);
+        bench.run("net/train_step_conv", {0, double(config.batch_size)}, [&] {
+            conv_net.learn(data, train);
+        }, STEPS);
+        bench.run("net/predict_conv", {0, double(data.size())}, [&] {
+            conv_net.predict(data, pool);
+        });
+    }
+}
+
+static void bench_loader(Bench& bench, BenchConfig const& config, Dataset const& data, std::string const& dir) {
+    std::vector<float> pixels(config.pixels);
+    auto line = csv_line(data[0]);
+    bench.run("loader/parse_csv_line", {double(line.size()), 1}, [&] {
+        DataLoader::parse_csv_line(line, pixels);
+    });
+
+    std::string header = "word";
+    for (std::size_t i = 0; i < config.pixels; i++) {
+        header += ",pixel[" + std::to_string(i) + "]";
+    }
+    std::size_t csv_bytes = 0;
+    std::vector<std::string> paths;
+    for (auto const* name: CLASS_NAMES) {
+        auto path = dir + "/" + name + ".csv";
+        auto file = std::ofstream(path, std::ios::out | std::ios::trunc);
+        file << header << '\n';
+        for (auto const& record: data) {
+            if (record.name == name) file << csv_line(record) << '\n';
+        }
+        csv_bytes += static_cast<std::size_t>(file.tellp());
+        paths.push_back(path);
+    }
+
+    auto pool = ThreadPool(config.threads);
+    bench.run("loader/parse_csv_file", {double(csv_bytes), double(data.size())}, [&] {
+        for (auto const& path: paths) {
+            DataLoader::parse_csv_file(path, pool);
+        }
+    });
+
+    // The first load writes the dataset cache, the timed ones read it back.
+    std::size_t cache_bytes = 0;
+    {
+        QuietStdout quiet;
+        DataLoader(dir).load(config.images, {}, config.threads);
+    }
+    for (auto const& path: paths) {
+        std::error_code error;
+        cache_bytes += std::filesystem::file_size(dataset_cache_path(path), error);
+    }
+    bench.run("loader/load/cache", {double(cache_bytes), double(data.size())}, [&] {
+        auto loader = DataLoader(dir);
+        loader.load(config.images, {}, config.threads);
+    });
+
+    // One image through each kind of stage, down to a quarter of the side.
+    auto side = static_cast<std::size_t>(std::lround(std::sqrt(static_cast<double>(config.pixels))));
+    if (side * side == config.pixels && side % 4 == 0) {
+        auto image_bytes = static_cast<double>(config.pixels) / 8;
+        for (auto [name, preprocessing]: {
+            std::pair{"loader/preprocess/max_pool", Preprocessing{0, false, PoolMode::Max, side / 4}},
+            std::pair{"loader/preprocess/average_pool", Preprocessing{0, false, PoolMode::Average, side / 4}},
+            std::pair{"loader/preprocess/bounding_box", Preprocessing{0, true, PoolMode::None, 0}},
+        }) {
+            bench.run(name, {image_bytes, 1}, [&, preprocessing = preprocessing] {
+                preprocessing.apply(data[0].image);
+            });
+        }
+    }
+}
+
+static void bench_io(Bench& bench, BenchConfig const& config, std::string const& dir) {
+    auto net = NeuralNet(make_config(config));
+    auto checkpoint = dir + "/weights.bin";
+    save_checkpoint(checkpoint, net.get_layers(), net.get_mapping());
+    auto size = static_cast<double>(std::filesystem::file_size(checkpoint));
+    bench.run("io/dump_weights", {size}, [&] {
+        save_checkpoint(checkpoint, net.get_layers(), net.get_mapping());
+    });
+    bench.run("io/load_checkpoint", {size}, [&] {
+        auto loaded = NeuralNet(FileConfig::from_file(checkpoint));
+    });
+    bench.run("io/load_checkpoint_verified", {size}, [&] {
+        auto loaded = NeuralNet(load_checkpoint(checkpoint, true));
+    });
+
+    // The legacy text format takes seconds for a full-size first layer, so
+    // it is measured on a model with at most 4096 inputs.
+    auto text_inputs = std::min<std::size_t>(config.pixels, 4096);
+    auto text_config = config;
+    text_config.pixels = text_inputs;
+    auto text_net = NeuralNet(make_config(text_config));
+    auto text_path = dir + "/weights.txt";
+    {
+        auto file = std::ofstream(text_path, std::ios::out | std::ios::trunc);
+        for (auto const& layer: text_net.get_layers()) {
+            file << "Layer\n";
+            auto weights = layer.float_weights();
+            for (std::size_t j = 0; j < weights.rows(); j++) {
+                file << "Node " << j << ":";
+                for (std::size_t i = 0; i < weights.cols(); i++) {
+                    file << ' ' << weights(j, i);
+                }
+                file << '\n';
+            }
+            file << "Bias:";
+            for (float bias: layer.get_bias_weights()) {
+                file << ' ' << bias;
+            }
+            file << '\n';
+        }
+    }
+    auto text_size = static_cast<double>(std::filesystem::file_size(text_path));
+    bench.run("io/load_weights_and_biases/" + std::to_string(text_inputs), {text_size}, [&] {
+        load_weights_and_biases(text_path);
+    });
+}
+
+int main(int argc, char** argv) {
+    auto config = parse_args(argc, argv);
+    auto dir = (std::filesystem::temp_directory_path() / ("classifier_bench_" + std::to_string(getpid()))).string();
+    std::filesystem::create_directories(dir);
+
+    std::fprintf(stderr, "kernels: %s, int8: %s, threads: %zu\n",
+        kernels::isa_name(kernels::active_isa()), kernels::int8_kernel_name(),
+        ThreadPool(config.threads).size());
+
+    auto gen = std::mt19937(42);
+    auto data = make_dataset(config, gen);
+    auto bench = Bench(config);
+    bench_layer(bench, config, data);
+    bench_net(bench, config, data);
+    bench_loader(bench, config, data, dir);
+    bench_io(bench, config, dir);
+
+    std::error_code error;
+    std::filesystem::remove_all(dir, error);
+}
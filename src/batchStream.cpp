@@ -0,0 +1,186 @@
+#include "batchStream.hpp"
+#include "datasetCache.hpp"
+#include "mappedFile.hpp"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <utility>
+
+struct BatchStream::Source {
+    std::string path;
+    StreamConfig const* config;
+    DatasetCacheReader cache;
+    std::size_t cache_index = 0;
+    std::shared_ptr<MappedFile> csv;
+    char const* cursor = nullptr;
+    char const* end = nullptr;
+    std::vector<float> pixels;
+    std::size_t position = 0;
+    bool done = false;
+
+    void open() {
+        cache_index = 0;
+        position = 0;
+        done = false;
+        if (cache.open(dataset_cache_path(path), path)) return;
+
+        csv = MappedFile::open(path);
+        if (!csv) {
+            std::cerr << "Failed opening file: " << path << '\n';
+            done = true;
+            return;
+        }
+        csv->advise_sequential();
+        cursor = csv->data();
+        end = cursor + csv->size();
+        auto const* header_end = std::find(cursor, end, '\n');
+        pixels.resize(std::count(cursor, header_end, ','));
+        cursor = header_end == end ? end : header_end + 1;
+    }
+
+    bool wanted(std::string_view name) {
+        auto const& names = config->names;
+        if (!names.empty() && std::find(names.begin(), names.end(), name) == names.end()) return false;
+        return position++ >= config->first_record;
+    }
+
+    bool next(Record& record) {
+        while (!done) {
+            if (position >= config->first_record + config->record_count) break;
+            if (cache.is_open()) {
+                if (cache_index == cache.size()) break;
+                auto index = cache_index++;
+                if (!wanted(cache.name(index))) continue;
+                record = cache.read(index);
+                return true;
+            }
+
+            if (cursor >= end) break;
+            auto const* line_end = std::find(cursor, end, '\n');
+            auto row = std::string_view(cursor, line_end - cursor);
+            cursor = line_end == end ? end : line_end + 1;
+            if (!row.empty() && row.back() == '\r') row.remove_suffix(1);
+            if (row.empty() || !wanted(row.substr(0, row.find(',')))) continue;
+            record = DataLoader::parse_csv_line(row, pixels);
+            return true;
+        }
+        done = true;
+        return false;
+    }
+};
+
+BatchStream::BatchStream(std::vector<std::string> paths, StreamConfig config):
+    paths_(std::move(paths)),
+    config_(std::move(config)),
+    producer_(&BatchStream::produce, this) {
+}
+
+BatchStream::~BatchStream() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    ready_changed_.notify_all();
+    producer_.join();
+}
+
+bool BatchStream::next(Dataset& batch) {
+    std::unique_lock lock(mutex_);
+    ready_changed_.wait(lock, [&]{ return !ready_.empty() || finished_; });
+    if (ready_.empty()) return false;
+    batch = std::move(ready_.front());
+    ready_.pop_front();
+    lock.unlock();
+    ready_changed_.notify_all();
+    return true;
+}
+
+Dataset BatchStream::collect() {
+    Dataset result;
+    Dataset batch;
+    while (next(batch)) {
+        std::move(batch.begin(), batch.end(), std::back_inserter(result));
+    }
+    return result;
+}
+
+bool BatchStream::push(Dataset&& batch) {
+    std::unique_lock lock(mutex_);
+    ready_changed_.wait(lock, [&]{ return ready_.size() < config_.prefetch || stopping_; });
+    if (stopping_) return false;
+    ready_.push_back(std::move(batch));
+    lock.unlock();
+    ready_changed_.notify_all();
+    return true;
+}
+
+void BatchStream::produce() {
+    std::vector<Source> sources(paths_.size());
+    for (std::size_t s = 0; s < sources.size(); s++) {
+        sources[s].path = paths_[s];
+        sources[s].config = &config_;
+        sources[s].open();
+    }
+
+    auto rng = std::mt19937(config_.seed);
+    auto window_size = config_.shuffle_window;
+    Dataset window;
+    window.reserve(window_size);
+    Dataset batch;
+    auto emit = [&](Record&& record) {
+        batch.push_back(std::move(record));
+        if (batch.size() < config_.batch_size) return true;
+        return push(std::exchange(batch, {}));
+    };
+
+    // Taking one record from every file in turn keeps the classes mixed even
+    // when the shuffle window is much smaller than a single file.
+    bool running = true;
+    std::size_t pass_records = 0;
+    Record record;
+    while (running) {
+        bool any = false;
+        for (auto& source: sources) {
+            if (!source.next(record)) continue;
+            any = true;
+            if (config_.preprocessing.enabled()) {
+                record.image = config_.preprocessing.apply(record.image);
+            }
+            pass_records++;
+            if (window.size() < window_size) {
+                window.push_back(std::move(record));
+                continue;
+            }
+            if (window_size > 0) {
+                std::swap(window[rng() % window_size], record);
+            }
+            if (!emit(std::move(record))) {
+                running = false;
+                break;
+            }
+        }
+        if (!any) {
+            if (!config_.repeat || pass_records == 0) break;
+            // A window larger than one pass would fill up with repeats of
+            // the same records before the first batch goes out.
+            window_size = std::min(window_size, window.size());
+            pass_records = 0;
+            for (auto& source: sources) source.open();
+        }
+    }
+
+    if (running) {
+        std::shuffle(window.begin(), window.end(), rng);
+        for (auto& pending: window) {
+            if (!emit(std::move(pending))) {
+                running = false;
+                break;
+            }
+        }
+    }
+    if (running && !batch.empty()) push(std::move(batch));
+
+    std::lock_guard lock(mutex_);
+    finished_ = true;
+    ready_changed_.notify_all();
+}
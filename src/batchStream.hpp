@@ -0,0 +1,58 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dataLoader.hpp"
+
+struct StreamConfig {
+    std::vector<std::string> names;                 // class filter, empty = every record
+    std::size_t first_record = 0;                   // per file range, counted over matching records
+    std::size_t record_count = std::numeric_limits<std::size_t>::max();
+    std::size_t batch_size = 16;
+    std::size_t shuffle_window = 4096;              // records held for shuffling (at most one pass), 0 = file order
+    std::size_t prefetch = 2;                       // decoded batches kept ready
+    bool repeat = true;                             // start over at the end of the files
+    unsigned int seed = std::random_device{}();
+    Preprocessing preprocessing = {};                // applied to each record as it is decoded
+};
+
+// Streams batches out of a set of CSV files without loading them whole.
+// A background thread reads the files round-robin (from their dataset cache
+// when it is up to date), shuffles through a bounded window and queues up
+// to `prefetch` batches, so decoding overlaps with training.
+class BatchStream {
+public:
+    BatchStream(std::vector<std::string> paths, StreamConfig config);
+    ~BatchStream();
+    BatchStream(BatchStream const&) = delete;
+    BatchStream& operator=(BatchStream const&) = delete;
+
+    // Blocks until the next batch is ready. Returns false once a
+    // non-repeating stream is exhausted.
+    bool next(Dataset& batch);
+    // Reads the rest of a non-repeating stream into memory.
+    Dataset collect();
+
+private:
+    struct Source;
+
+    std::vector<std::string> paths_;
+    StreamConfig config_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_changed_;
+    std::deque<Dataset> ready_;
+    bool finished_ = false;
+    bool stopping_ = false;
+    std::thread producer_;
+
+    void produce();
+    bool push(Dataset&& batch);
+};
@@ -0,0 +1,359 @@
+#include "checkpoint.hpp"
+#include "nn.hpp"
+#include "mappedFile.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+static constexpr char CHECKPOINT_MAGIC[8] = {'N', 'N', 'N', 'C', 'K', 'P', 'T', '\0'};
+
+static_assert(sizeof(CheckpointHeader) == CHECKPOINT_ALIGNMENT);
+static_assert(sizeof(CheckpointLayer) % 8 == 0);
+
+enum ActivationId : std::uint32_t {
+    ACTIVATION_RELU = 0,
+    ACTIVATION_SIGMOID = 1,
+    ACTIVATION_FAST_SIGMOID = 2,
+    ACTIVATION_NONE = 3,        // pooling layers
+};
+
+static std::uint32_t activation_id(ActivationFunction function) {
+    if (function == nullptr) return ACTIVATION_NONE;
+    if (function == ReLu) return ACTIVATION_RELU;
+    if (function == sigm) return ACTIVATION_SIGMOID;
+    if (function == fast_sigm) return ACTIVATION_FAST_SIGMOID;
+    std::cerr << "Activation function cannot be stored in a checkpoint\n";
+    exit(1);
+}
+
+static std::pair<ActivationFunction, ActivationFunction> activation_from_id(std::uint32_t id) {
+    switch (id) {
+        case ACTIVATION_RELU: return {ReLu, ReLu_derivative};
+        case ACTIVATION_SIGMOID: return {sigm, sigm_derivative};
+        case ACTIVATION_FAST_SIGMOID: return {fast_sigm, fast_sigm_derivative};
+        case ACTIVATION_NONE: return {nullptr, nullptr};
+    }
+    std::cerr << "Unknown activation id in checkpoint: " << id << '\n';
+    exit(1);
+}
+
+static std::size_t weight_size(WeightFormat format) {
+    return format == WeightFormat::Float32 ? sizeof(float) : sizeof(std::uint16_t);
+}
+
+static std::size_t align_up(std::size_t value) {
+    return (value + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+// Word-wise multiplicative hash; all checksummed sections are padded to
+// CHECKPOINT_ALIGNMENT so they can be hashed piecewise, 8 bytes at a time.
+static std::uint64_t update_checksum(std::uint64_t hash, void const* data, std::size_t size) {
+    auto const* bytes = static_cast<unsigned char const*>(data);
+    for (std::size_t i = 0; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static constexpr std::uint64_t CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+
+// Rebuilds the geometry of a layer entry and checks it against the weight shape.
+static LayerGeometry layer_geometry(CheckpointLayer const& entry) {
+    auto kind = static_cast<LayerKind>(entry.kind);
+    if (kind == LayerKind::Dense) return {};
+    auto input = FeatureMap{entry.in_channels, entry.in_height, entry.in_width};
+    LayerGeometry geometry;
+    bool valid = false;
+    if (kind == LayerKind::Conv2D) {
+        geometry = LayerGeometry::conv2d(input, entry.out_channels, entry.kernel, entry.step, entry.padding);
+        valid = entry.out_size == geometry.output.channels && entry.in_size == geometry.patch_size()
+            && entry.weight_format == static_cast<std::uint32_t>(WeightFormat::Float32);
+    } else if (kind == LayerKind::MaxPool2D) {
+        geometry = LayerGeometry::max_pool2d(input, entry.kernel, entry.step);
+        valid = entry.out_size == 0 && entry.out_channels == geometry.output.channels;
+    }
+    if (!valid) {
+        std::cerr << "Corrupted convolution or pooling layer in checkpoint\n";
+        exit(1);
+    }
+    return geometry;
+}
+
+bool is_checkpoint(std::string const& filepath) {
+    auto file = std::ifstream(filepath, std::ios::binary);
+    char magic[sizeof(CHECKPOINT_MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0;
+}
+
+// Where the blocks of one layer come from, either a live Layer or a snapshot.
+struct LayerSource {
+    std::uint64_t in_size;
+    std::uint64_t out_size;
+    std::uint64_t stride;
+    std::uint32_t activation_id;
+    WeightFormat format;
+    LayerGeometry geometry;
+    void const* weights;
+    float const* biases;
+};
+
+static LayerSource layer_source(Layer const& layer) {
+    auto format = layer.get_weight_format();
+    auto half = format != WeightFormat::Float32;
+    auto const& weights = layer.get_weights();
+    auto const& half_weights = layer.get_half_weights();
+    return {
+        half ? half_weights.cols() : weights.cols(),
+        half ? half_weights.rows() : weights.rows(),
+        half ? half_weights.stride() : weights.stride(),
+        activation_id(layer.get_activation()),
+        format,
+        layer.get_geometry(),
+        half ? static_cast<void const*>(layer.get_half_weights().data()) : layer.get_weights().data(),
+        layer.get_bias_weights().data(),
+    };
+}
+
+// Prints why and returns false when the file cannot be opened or written.
+static bool write_checkpoint(
+    std::string const& filepath,
+    std::vector<LayerSource> const& layers,
+    std::map<std::string, std::size_t> const& mapping
+) {
+    auto metadata = std::string(layers.size() * sizeof(CheckpointLayer), '\0');
+    for (auto const& [name, index]: mapping) {
+        std::uint32_t entry[2] = {static_cast<std::uint32_t>(index), static_cast<std::uint32_t>(name.size())};
+        metadata.append(reinterpret_cast<char const*>(entry), sizeof(entry));
+        metadata += name;
+    }
+    metadata.resize(align_up(metadata.size()), '\0');
+
+    auto offset = sizeof(CheckpointHeader) + metadata.size();
+    for (std::size_t l = 0; l < layers.size(); l++) {
+        auto const& layer = layers[l];
+        CheckpointLayer entry = {};
+        entry.in_size = layer.in_size;
+        entry.out_size = layer.out_size;
+        entry.stride = layer.stride;
+        entry.activation_id = layer.activation_id;
+        entry.weight_format = static_cast<std::uint32_t>(layer.format);
+        auto const& geometry = layer.geometry;
+        if (!geometry.is_dense()) {
+            entry.kind = static_cast<std::uint32_t>(geometry.kind);
+            entry.in_channels = static_cast<std::uint32_t>(geometry.input.channels);
+            entry.in_height = static_cast<std::uint32_t>(geometry.input.height);
+            entry.in_width = static_cast<std::uint32_t>(geometry.input.width);
+            entry.out_channels = static_cast<std::uint32_t>(geometry.output.channels);
+            entry.kernel = static_cast<std::uint32_t>(geometry.kernel);
+            entry.step = static_cast<std::uint32_t>(geometry.stride);
+            entry.padding = static_cast<std::uint32_t>(geometry.padding);
+        }
+        entry.weights_offset = offset;
+        offset += align_up(entry.out_size * entry.stride * weight_size(layer.format));
+        entry.biases_offset = offset;
+        offset += align_up(entry.out_size * sizeof(float));
+        std::memcpy(metadata.data() + l * sizeof(entry), &entry, sizeof(entry));
+    }
+
+    auto file = std::ofstream(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open checkpoint for writing: " << filepath << '\n';
+        return false;
+    }
+
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.layer_count = static_cast<std::uint32_t>(layers.size());
+    header.class_count = static_cast<std::uint32_t>(mapping.size());
+    header.file_size = offset;
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+    auto checksum = update_checksum(CHECKSUM_SEED, metadata.data(), metadata.size());
+    header.metadata_checksum = checksum;
+    file.write(metadata.data(), metadata.size());
+
+    auto write_block = [&](void const* data, std::size_t size) {
+        auto const* bytes = static_cast<char const*>(data);
+        auto padded = std::string();
+        if (size % CHECKPOINT_ALIGNMENT != 0) {
+            padded.assign(bytes, size);
+            padded.resize(align_up(size), '\0');
+            bytes = padded.data();
+            size = padded.size();
+        }
+        checksum = update_checksum(checksum, bytes, size);
+        file.write(bytes, size);
+    };
+
+    for (auto const& layer: layers) {
+        write_block(layer.weights, layer.out_size * layer.stride * weight_size(layer.format));
+        write_block(layer.biases, layer.out_size * sizeof(float));
+    }
+
+    header.checksum = checksum;
+    file.seekp(0);
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    file.close();
+    if (!file) {
+        std::cerr << "Failed to write checkpoint: " << filepath << '\n';
+        return false;
+    }
+    return true;
+}
+
+void save_checkpoint(
+    std::string const& filepath,
+    std::vector<Layer> const& layers,
+    std::map<std::string, std::size_t> const& mapping
+) {
+    std::vector<LayerSource> sources;
+    for (auto const& layer: layers) {
+        sources.push_back(layer_source(layer));
+    }
+    if (!write_checkpoint(filepath, sources, mapping)) exit(1);
+}
+
+void snapshot_layer(Layer const& layer, LayerSnapshot& snapshot) {
+    auto source = layer_source(layer);
+    snapshot.in_size = source.in_size;
+    snapshot.out_size = source.out_size;
+    snapshot.stride = source.stride;
+    snapshot.activation_id = source.activation_id;
+    snapshot.format = source.format;
+    snapshot.geometry = source.geometry;
+    auto const* weights = static_cast<unsigned char const*>(source.weights);
+    snapshot.weights.resize(source.out_size * source.stride * weight_size(source.format));
+    std::copy(weights, weights + snapshot.weights.size(), snapshot.weights.data());
+    snapshot.biases.assign(source.biases, source.biases + source.out_size);
+}
+
+bool save_checkpoint(
+    std::string const& filepath,
+    std::vector<LayerSnapshot> const& layers,
+    std::map<std::string, std::size_t> const& mapping
+) {
+    std::vector<LayerSource> sources;
+    for (auto const& layer: layers) {
+        sources.push_back({
+            layer.in_size,
+            layer.out_size,
+            layer.stride,
+            layer.activation_id,
+            layer.format,
+            layer.geometry,
+            layer.weights.data(),
+            layer.biases.data(),
+        });
+    }
+    return write_checkpoint(filepath, sources, mapping);
+}
+
+FileConfig load_checkpoint(std::string const& filepath, bool verify) {
+    // Private writable mapping: pages are shared with the page cache until a
+    // layer is trained further, and the file itself is never modified.
+    auto mapping = MappedFile::open(filepath, MappedFile::Mode::CopyOnWrite);
+    if (!mapping || mapping->size() < sizeof(CheckpointHeader)) {
+        std::cerr << "Failed to map checkpoint: " << filepath << '\n';
+        exit(1);
+    }
+    mapping->advise_will_need();
+    auto* base = mapping->data();
+    auto size = mapping->size();
+
+    CheckpointHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0
+        || header.version < 1 || header.version > CHECKPOINT_VERSION
+        || header.file_size != size) {
+        std::cerr << "Unsupported or truncated checkpoint: " << filepath << '\n';
+        exit(1);
+    }
+
+    // Layer tables before version 3 end where the geometry starts.
+    auto entry_size = header.version < 3 ? offsetof(CheckpointLayer, kind) : sizeof(CheckpointLayer);
+    if (header.layer_count > (size - sizeof(header)) / entry_size) {
+        std::cerr << "Corrupted checkpoint layer table: " << filepath << '\n';
+        exit(1);
+    }
+    auto const* cursor = base + sizeof(header);
+    std::vector<CheckpointLayer> entries(header.layer_count, CheckpointLayer{});
+    for (auto& entry: entries) {
+        std::memcpy(&entry, cursor, entry_size);
+        cursor += entry_size;
+    }
+
+    // The metadata runs up to the first block, which the writer places right
+    // after it; a file without layers is all metadata.
+    std::uint64_t metadata_end = entries.empty() ? size : entries[0].weights_offset;
+    if (metadata_end < static_cast<std::uint64_t>(cursor - base) || metadata_end > size
+        || metadata_end % CHECKPOINT_ALIGNMENT != 0) {
+        std::cerr << "Corrupted checkpoint layer table: " << filepath << '\n';
+        exit(1);
+    }
+    auto checksum = update_checksum(CHECKSUM_SEED, base + sizeof(header), metadata_end - sizeof(header));
+    if (header.version >= 4 && checksum != header.metadata_checksum) {
+        std::cerr << "Checkpoint checksum mismatch: " << filepath << '\n';
+        exit(1);
+    }
+    if (verify || header.version < 4) {
+        checksum = update_checksum(checksum, base + metadata_end, size - metadata_end);
+        if (checksum != header.checksum) {
+            std::cerr << "Checkpoint checksum mismatch: " << filepath << '\n';
+            exit(1);
+        }
+    }
+
+    FileConfig result;
+    auto const* metadata_limit = base + metadata_end;
+    for (std::uint32_t c = 0; c < header.class_count; c++) {
+        std::uint32_t entry[2];
+        if (static_cast<std::size_t>(metadata_limit - cursor) < sizeof(entry)) {
+            std::cerr << "Corrupted checkpoint class mapping: " << filepath << '\n';
+            exit(1);
+        }
+        std::memcpy(entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+        if (static_cast<std::size_t>(metadata_limit - cursor) < entry[1]) {
+            std::cerr << "Corrupted checkpoint class mapping: " << filepath << '\n';
+            exit(1);
+        }
+        result.mapping[std::string(cursor, entry[1])] = entry[0];
+        cursor += entry[1];
+    }
+
+    for (auto& entry: entries) {
+        if (header.version == 1) entry.weight_format = 0;
+        auto format = static_cast<WeightFormat>(entry.weight_format);
+        if (format != WeightFormat::Float32 && format != WeightFormat::BFloat16 && format != WeightFormat::Float16) {
+            std::cerr << "Unknown weight format in checkpoint: " << entry.weight_format << '\n';
+            exit(1);
+        }
+        // Biases always follow the weights, which covers the one element
+        // past the end that the half gathers may read.
+        if (entry.weights_offset + entry.out_size * entry.stride * weight_size(format) > size
+            || entry.biases_offset + entry.out_size * sizeof(float) > size) {
+            std::cerr << "Corrupted checkpoint layer table: " << filepath << '\n';
+            exit(1);
+        }
+        auto const* biases = reinterpret_cast<float const*>(base + entry.biases_offset);
+        auto [function, derivative] = activation_from_id(entry.activation_id);
+        WeightConfig layer = {{}, std::vector<float>(biases, biases + entry.out_size), function, derivative, format, {}, layer_geometry(entry)};
+        if (format == WeightFormat::Float32) {
+            auto* weights = reinterpret_cast<float*>(base + entry.weights_offset);
+            layer.weights = Matrix::view(weights, entry.out_size, entry.in_size, entry.stride, mapping);
+        } else {
+            auto* weights = reinterpret_cast<std::uint16_t*>(base + entry.weights_offset);
+            layer.half_weights = HalfMatrix::view(format, weights, entry.out_size, entry.in_size, entry.stride, mapping);
+        }
+        result.layer_data.push_back(std::move(layer));
+    }
+    result.loss = MSE;
+    return result;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "convolution.hpp"
+#include "kernels.hpp"
+
+struct FileConfig;
+class Layer;
+
+// Binary model checkpoint (little-endian):
+//   CheckpointHeader                 magic, version, counts, file size, checksum
+//   CheckpointLayer[layer_count]     weight shapes, activation id, block offsets, geometry
+//   class mapping                    (index, name length, name bytes) per class
+//   raw blocks                       per layer: weights (out x stride elements), biases
+// Every section starts on a CHECKPOINT_ALIGNMENT boundary, so a mapped file
+// can back the weight matrices directly. The checksum covers everything
+// after the header; metadata_checksum covers the layer table and class
+// mapping alone, and the full checksum continues from it over the blocks.
+// Version 2 added the per-layer weight format: half-format layers store
+// their bf16/fp16 weights (2 bytes per element), never the fp32 master.
+// Version 3 added convolution and pooling layers: in_size/out_size are the
+// shape of the weight matrix (one row per output channel for Conv2D, empty
+// for MaxPool2D) and the geometry fields follow; older layer tables lack them.
+// Version 4 added metadata_checksum; older files are always checked in full.
+// Version 1 files are read as all fp32.
+constexpr std::uint32_t CHECKPOINT_VERSION = 4;
+constexpr std::size_t CHECKPOINT_ALIGNMENT = 64;
+
+struct CheckpointHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t layer_count;
+    std::uint32_t class_count;
+    std::uint32_t reserved;
+    std::uint64_t file_size;
+    std::uint64_t checksum;
+    std::uint64_t metadata_checksum;
+    std::uint8_t padding[16];
+};
+
+struct CheckpointLayer {
+    std::uint64_t in_size;
+    std::uint64_t out_size;
+    std::uint64_t stride;
+    std::uint32_t activation_id;
+    std::uint32_t weight_format;
+    std::uint64_t weights_offset;
+    std::uint64_t biases_offset;
+    std::uint32_t kind;             // LayerKind, the rest is zero for dense layers
+    std::uint32_t in_channels;
+    std::uint32_t in_height;
+    std::uint32_t in_width;
+    std::uint32_t out_channels;
+    std::uint32_t kernel;
+    std::uint32_t step;
+    std::uint32_t padding;
+};
+
+// What a checkpoint stores of one layer, copied out of it: the weights as
+// written to disk (fp32, or the bf16/fp16 copy of a half layer) and the
+// biases. Refilling a snapshot reuses its buffers.
+struct LayerSnapshot {
+    std::uint64_t in_size = 0;
+    std::uint64_t out_size = 0;
+    std::uint64_t stride = 0;
+    std::uint32_t activation_id = 0;
+    kernels::WeightFormat format = kernels::WeightFormat::Float32;
+    LayerGeometry geometry = {};
+    std::vector<unsigned char> weights;
+    std::vector<float> biases;
+};
+
+bool is_checkpoint(std::string const& filepath);
+// Exits when the file cannot be written.
+void save_checkpoint(
+    std::string const& filepath,
+    std::vector<Layer> const& layers,
+    std::map<std::string, std::size_t> const& mapping
+);
+void snapshot_layer(Layer const& layer, LayerSnapshot& snapshot);
+// For background writers: reports a failed write and returns false, leaving
+// whatever part of the file was written for the caller to remove.
+bool save_checkpoint(
+    std::string const& filepath,
+    std::vector<LayerSnapshot> const& layers,
+    std::map<std::string, std::size_t> const& mapping
+);
+// Maps the file copy-on-write; the returned weight matrices point into the mapping.
+// Only the header and metadata are checksummed unless `verify` is set, so
+// loading does not read every weight page up front.
+FileConfig load_checkpoint(std::string const& filepath, bool verify = false);
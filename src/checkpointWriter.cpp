@@ -0,0 +1,100 @@
+#include "checkpointWriter.hpp"
+#include "nn.hpp"
+#include <filesystem>
+#include <iostream>
+
+CheckpointWriter::CheckpointWriter(std::string path):
+    path_(std::move(path)),
+    writer_(&CheckpointWriter::write_loop, this) {
+    auto parent = std::filesystem::path(path_).parent_path();
+    if (!parent.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(parent, error);
+    }
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    changed_.notify_all();
+    writer_.join();
+}
+
+void CheckpointWriter::submit(std::vector<Layer> const& layers, std::map<std::string, std::size_t> const& mapping) {
+    Slot* slot = nullptr;
+    {
+        std::lock_guard lock(mutex_);
+        // The writer owns at most one slot, so one is always Queued or Free.
+        for (auto& candidate: slots_) {
+            if (candidate.state == SlotState::Queued) slot = &candidate;
+        }
+        for (auto& candidate: slots_) {
+            if (slot == nullptr && candidate.state == SlotState::Free) slot = &candidate;
+        }
+        slot->state = SlotState::Filling;
+    }
+
+    slot->layers.resize(layers.size());
+    for (std::size_t l = 0; l < layers.size(); l++) {
+        snapshot_layer(layers[l], slot->layers[l]);
+    }
+    slot->mapping = mapping;
+
+    {
+        std::lock_guard lock(mutex_);
+        slot->state = SlotState::Queued;
+    }
+    changed_.notify_all();
+}
+
+void CheckpointWriter::flush() {
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [&]{
+        for (auto const& slot: slots_) {
+            if (slot.state != SlotState::Free) return false;
+        }
+        return true;
+    });
+}
+
+std::size_t CheckpointWriter::written() const {
+    std::lock_guard lock(mutex_);
+    return written_;
+}
+
+void CheckpointWriter::write_loop() {
+    auto temporary = path_ + ".tmp";
+    std::unique_lock lock(mutex_);
+    while (true) {
+        Slot* slot = nullptr;
+        changed_.wait(lock, [&]{
+            for (auto& candidate: slots_) {
+                if (candidate.state == SlotState::Queued) slot = &candidate;
+            }
+            return slot != nullptr || stopping_;
+        });
+        if (slot == nullptr) return;
+        slot->state = SlotState::Writing;
+        lock.unlock();
+
+        // A failed write only costs this checkpoint; training goes on and
+        // the previous file stays in place.
+        bool saved = save_checkpoint(temporary, slot->layers, slot->mapping);
+        std::error_code error;
+        if (saved) {
+            std::filesystem::rename(temporary, path_, error);
+            if (error) {
+                std::cerr << "Failed to replace checkpoint " << path_ << ": " << error.message() << '\n';
+            }
+        } else {
+            std::filesystem::remove(temporary, error);
+        }
+
+        lock.lock();
+        slot->state = SlotState::Free;
+        written_ += saved && !error;
+        changed_.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "checkpoint.hpp"
+
+class Layer;
+
+// Saves checkpoints on a background thread while training goes on. Two
+// snapshot buffers alternate: the writer serializes one while submit()
+// copies the layers into the other, so submit() never waits for the disk.
+// Files are written next to the target and renamed over it, so a crash
+// mid-write leaves the previous checkpoint intact.
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(std::string path);
+    // Writes whatever is still queued before returning.
+    ~CheckpointWriter();
+    CheckpointWriter(CheckpointWriter const&) = delete;
+    CheckpointWriter& operator=(CheckpointWriter const&) = delete;
+
+    // A snapshot still queued behind a slow write is replaced by the newer one.
+    void submit(std::vector<Layer> const& layers, std::map<std::string, std::size_t> const& mapping);
+    // Blocks until every submitted snapshot is on disk.
+    void flush();
+    std::size_t written() const;
+    std::string const& path() const { return path_; }
+
+private:
+    enum class SlotState {
+        Free,
+        Filling,
+        Queued,
+        Writing,
+    };
+
+    struct Slot {
+        std::vector<LayerSnapshot> layers;
+        std::map<std::string, std::size_t> mapping;
+        SlotState state = SlotState::Free;
+    };
+
+    std::string path_;
+    std::array<Slot, 2> slots_;
+    std::size_t written_ = 0;
+    bool stopping_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread writer_;
+
+    void write_loop();
+};
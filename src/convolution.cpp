@@ -0,0 +1,167 @@
+#include "convolution.hpp"
+#include <algorithm>
+#include <iostream>
+#include <utility>
+
+static std::size_t windows(std::size_t side, std::size_t kernel, std::size_t stride, std::size_t padding) {
+    if (kernel == 0 || stride == 0 || side + 2 * padding < kernel) {
+        std::cerr << "A " << kernel << " pixel window with stride " << stride << " and padding " << padding
+            << " does not fit a side of " << side << '\n';
+        exit(1);
+    }
+    return (side + 2 * padding - kernel) / stride + 1;
+}
+
+LayerGeometry LayerGeometry::conv2d(FeatureMap input, std::size_t channels, std::size_t kernel, std::size_t stride, std::size_t padding) {
+    if (channels == 0 || input.channels == 0) {
+        std::cerr << "Convolutions need at least one input and one output channel\n";
+        exit(1);
+    }
+    auto output = FeatureMap{
+        channels,
+        windows(input.height, kernel, stride, padding),
+        windows(input.width, kernel, stride, padding),
+    };
+    return {LayerKind::Conv2D, input, output, kernel, stride, padding};
+}
+
+LayerGeometry LayerGeometry::max_pool2d(FeatureMap input, std::size_t kernel, std::size_t stride) {
+    auto output = FeatureMap{
+        input.channels,
+        windows(input.height, kernel, stride, 0),
+        windows(input.width, kernel, stride, 0),
+    };
+    return {LayerKind::MaxPool2D, input, output, kernel, stride, 0};
+}
+
+// Output columns [first, last) whose window column kx lands inside the
+// image; the rest read padding.
+static std::pair<std::size_t, std::size_t> inside(LayerGeometry const& geometry, std::size_t kx) {
+    auto stride = static_cast<long>(geometry.stride);
+    auto offset = static_cast<long>(kx) - static_cast<long>(geometry.padding);
+    auto width = static_cast<long>(geometry.input.width);
+    auto outputs = static_cast<long>(geometry.output.width);
+    auto first = offset >= 0 ? 0 : (-offset + stride - 1) / stride;
+    auto last = offset >= width ? 0 : std::min(outputs, (width - 1 - offset) / stride + 1);
+    first = std::min(first, outputs);
+    return {static_cast<std::size_t>(first), static_cast<std::size_t>(std::max(first, last))};
+}
+
+// Walks the columns of output rows [first_row, last_row) one output row at a
+// time. For every (channel, ky, kx, oy) whose window row lands inside the
+// image, visit() gets the column row, the first column of that output row,
+// the offset of the image row it reads and the output x range that reads
+// inside it (x = ox * stride + x_offset); blank() gets the other output rows.
+template<typename Visit, typename Blank>
+static void for_each_window_row(
+    LayerGeometry const& geometry,
+    std::size_t first_row,
+    std::size_t last_row,
+    Visit const& visit,
+    Blank const& blank
+) {
+    auto const& in = geometry.input;
+    auto const& out = geometry.output;
+    auto kernel = geometry.kernel;
+    auto padding = static_cast<long>(geometry.padding);
+    for (std::size_t c = 0; c < in.channels; c++) {
+        for (std::size_t ky = 0; ky < kernel; ky++) {
+            for (std::size_t kx = 0; kx < kernel; kx++) {
+                auto row = (c * kernel + ky) * kernel + kx;
+                auto [first, last] = inside(geometry, kx);
+                auto x_offset = static_cast<long>(kx) - padding;
+                for (std::size_t oy = first_row; oy < last_row; oy++) {
+                    auto y = static_cast<long>(oy * geometry.stride + ky) - padding;
+                    auto position = (oy - first_row) * out.width;
+                    if (y < 0 || y >= static_cast<long>(in.height)) {
+                        blank(row, position);
+                        continue;
+                    }
+                    visit(row, position, c * in.area() + y * in.width, first, last, x_offset);
+                }
+            }
+        }
+    }
+}
+
+void im2col(LayerGeometry const& geometry, float const* image, std::size_t first_row, std::size_t last_row, Matrix& columns) {
+    auto width = geometry.output.width;
+    auto stride = geometry.stride;
+    columns.resize(geometry.patch_size(), (last_row - first_row) * width);
+    for_each_window_row(geometry, first_row, last_row,
+        [&](std::size_t row, std::size_t position, std::size_t source, std::size_t first, std::size_t last, long x_offset) {
+            auto* out = columns.row(row) + position;
+            // The first input read; x_offset alone may point before the image.
+            auto const* in = image + source + static_cast<long>(first * stride) + x_offset;
+            std::fill(out, out + first, 0.0f);
+            if (stride == 1) {
+                std::copy(in, in + (last - first), out + first);
+            } else {
+                for (auto ox = first; ox < last; ox++) {
+                    out[ox] = in[(ox - first) * stride];
+                }
+            }
+            std::fill(out + last, out + width, 0.0f);
+        },
+        [&](std::size_t row, std::size_t position) {
+            auto* out = columns.row(row) + position;
+            std::fill(out, out + width, 0.0f);
+        });
+}
+
+void col2im(LayerGeometry const& geometry, Matrix const& columns, std::size_t first_row, std::size_t last_row, float* image) {
+    auto stride = geometry.stride;
+    for_each_window_row(geometry, first_row, last_row,
+        [&](std::size_t row, std::size_t position, std::size_t target, std::size_t first, std::size_t last, long x_offset) {
+            auto const* in = columns.row(row) + position;
+            auto* out = image + target + static_cast<long>(first * stride) + x_offset;
+            for (auto ox = first; ox < last; ox++) {
+                out[(ox - first) * stride] += in[ox];
+            }
+        },
+        [](std::size_t, std::size_t) {});
+}
+
+void max_pool(LayerGeometry const& geometry, float const* image, float* result) {
+    auto const& in = geometry.input;
+    auto const& out = geometry.output;
+    for (std::size_t c = 0; c < in.channels; c++) {
+        auto const* channel = image + c * in.area();
+        for (std::size_t oy = 0; oy < out.height; oy++) {
+            auto* out_row = result + c * out.area() + oy * out.width;
+            for (std::size_t ox = 0; ox < out.width; ox++) {
+                auto const* window = channel + oy * geometry.stride * in.width + ox * geometry.stride;
+                auto best = window[0];
+                for (std::size_t ky = 0; ky < geometry.kernel; ky++) {
+                    for (std::size_t kx = 0; kx < geometry.kernel; kx++) {
+                        best = std::max(best, window[ky * in.width + kx]);
+                    }
+                }
+                out_row[ox] = best;
+            }
+        }
+    }
+}
+
+void max_pool_backward(LayerGeometry const& geometry, float const* image, float const* node, float* previous_node) {
+    auto const& in = geometry.input;
+    auto const& out = geometry.output;
+    std::fill(previous_node, previous_node + in.size(), 0.0f);
+    for (std::size_t c = 0; c < in.channels; c++) {
+        auto const* channel = image + c * in.area();
+        for (std::size_t oy = 0; oy < out.height; oy++) {
+            auto const* node_row = node + c * out.area() + oy * out.width;
+            for (std::size_t ox = 0; ox < out.width; ox++) {
+                auto corner = oy * geometry.stride * in.width + ox * geometry.stride;
+                auto winner = corner;
+                for (std::size_t ky = 0; ky < geometry.kernel; ky++) {
+                    for (std::size_t kx = 0; kx < geometry.kernel; kx++) {
+                        auto index = corner + ky * in.width + kx;
+                        if (channel[index] > channel[winner]) winner = index;
+                    }
+                }
+                previous_node[c * in.area() + winner] += node_row[ox];
+            }
+        }
+    }
+}
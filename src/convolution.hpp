@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "matrix.hpp"
+
+enum class LayerKind : std::uint32_t {
+    Dense = 0,
+    Conv2D = 1,
+    MaxPool2D = 2,
+};
+
+// `channels` images of height x width, stored one channel after the other,
+// each row-major: the layout of one batch row.
+struct FeatureMap {
+    std::size_t channels = 0;
+    std::size_t height = 0;
+    std::size_t width = 0;
+
+    std::size_t area() const { return height * width; }
+    std::size_t size() const { return channels * area(); }
+};
+
+// Shapes of a convolution or pooling layer: square kernel x kernel windows
+// moved by `stride`, over an input zero-padded by `padding` on every side
+// (Conv2D only). Dense layers keep the all-zero default.
+struct LayerGeometry {
+    LayerKind kind = LayerKind::Dense;
+    FeatureMap input = {};
+    FeatureMap output = {};
+    std::size_t kernel = 0;
+    std::size_t stride = 0;
+    std::size_t padding = 0;
+
+    // Both exit with a message when the windows do not fit the input.
+    static LayerGeometry conv2d(FeatureMap input, std::size_t channels, std::size_t kernel, std::size_t stride, std::size_t padding);
+    static LayerGeometry max_pool2d(FeatureMap input, std::size_t kernel, std::size_t stride);
+
+    bool is_dense() const { return kind == LayerKind::Dense; }
+    // Conv2D weights are output.channels x patch_size(), one bias per output channel.
+    std::size_t patch_size() const { return input.channels * kernel * kernel; }
+};
+
+// Unrolls the windows of output rows [first_row, last_row) of one image into
+// `columns`: one row per (channel, ky, kx) of a patch, one column per output
+// position, so the convolution of all output channels is a single
+// weights * columns product. Callers go a block of rows at a time to keep
+// the unrolled patches in cache.
+void im2col(LayerGeometry const& geometry, float const* image, std::size_t first_row, std::size_t last_row, Matrix& columns);
+// The reverse of im2col: adds each column entry onto the image position it
+// was read from.
+void col2im(LayerGeometry const& geometry, Matrix const& columns, std::size_t first_row, std::size_t last_row, float* image);
+
+void max_pool(LayerGeometry const& geometry, float const* image, float* result);
+// Overwrites `previous_node` with each output's gradient routed to the first
+// input that won its window; the winners are found again from `image`.
+void max_pool_backward(LayerGeometry const& geometry, float const* image, float const* node, float* previous_node);
@@ -1,7 +1,13 @@
 #include "dataLoader.hpp"
-#include <sstream>
-#include <fstream>
+#include "datasetCache.hpp"
+#include "mappedFile.hpp"
+#include "threadPool.hpp"
+#include <charconv>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <filesystem>
 
 
@@ -16,7 +22,7 @@ DataLoader::DataLoader(std::string const& data_dir) {
         }
 
         for (auto const& entry: directory_iterator(data_dir)) {
-            if (entry.is_directory()) continue;
+            if (entry.is_directory() || entry.path().extension() != ".csv") continue;
             csv_filepaths_.push_back(entry.path());
         }
 
@@ -25,45 +31,140 @@ DataLoader::DataLoader(std::string const& data_dir) {
     }
 }
 
-void DataLoader::load(unsigned int batch_size, std::vector<std::string> const& names) {
+void DataLoader::load(unsigned int batch_size, std::vector<std::string> const& names, std::size_t threads) {
     bool name_filer_active = names.size() > 0;
+    auto should_load = [&](std::string const& entry_name){
+        return std::find(names.begin(), names.end(), entry_name) != names.end();
+    };
+    std::unique_ptr<ThreadPool> pool;
+    auto first_new = loaded_data_.size();
+
     for (auto const& path: csv_filepaths_) {
-        auto file = std::fstream(path);
-        if (!file.is_open()) {
-            std::cout << "Failed opening file: "  << path << '\n';
+        unsigned int record_count = 0;
+        auto take = [&](Record&& entry) {
+            loaded_names_.insert(entry.name);
+            if (name_filer_active && !should_load(entry.name)) return false;
+            loaded_data_.push_back(std::move(entry));
+            return ++record_count < batch_size;
+        };
+
+        auto cache_path = dataset_cache_path(path);
+        if (read_dataset_cache(cache_path, path, take)) {
+            std::cout << "Loaded cache: " << cache_path << '\n';
             continue;
         }
+
         std::cout << "Loading: " << path << '\n';
-        unsigned int line_count = 0;
-        std::string line;
-        auto should_load = [&](std::string const& entry_name){
-            return std::find(names.begin(), names.end(), entry_name) != names.end();
-        };
+        if (!pool) pool = std::make_unique<ThreadPool>(threads);
+        auto records = parse_csv_file(path, *pool);
+        if (write_dataset_cache(cache_path, path, records)) {
+            std::cout << "Wrote cache: " << cache_path << '\n';
+        }
+        for (auto& record: records) {
+            if (!take(std::move(record))) break;
+        }
+    }
+
+    if (preprocessing_.enabled() && loaded_data_.size() > first_new) {
+        if (!pool) pool = std::make_unique<ThreadPool>(threads);
+        auto count = loaded_data_.size() - first_new;
+        auto chunks = std::min(pool->size(), count);
+        pool->parallel_for(chunks, [&](std::size_t chunk) {
+            for (auto r = first_new + count * chunk / chunks; r < first_new + count * (chunk + 1) / chunks; r++) {
+                loaded_data_[r].image = preprocessing_.apply(loaded_data_[r].image);
+            }
+        });
+    }
+}
+
+void DataLoader::set_preprocessing(Preprocessing preprocessing) {
+    preprocessing_ = preprocessing;
+}
+
+Dataset DataLoader::parse_csv_file(std::string const& path, ThreadPool& pool) {
+    Dataset result;
+    auto mapping = MappedFile::open(path);
+    if (!mapping) {
+        std::cout << "Failed opening file: "  << path << '\n';
+        return result;
+    }
+    mapping->advise_sequential();
+    auto const* begin = mapping->data();
+    auto const* end = begin + mapping->size();
+
+    auto const* body = std::find(begin, end, '\n');
+    auto width = static_cast<std::size_t>(std::count(begin, body, ','));
+    if (body != end) body++;
 
-        while (std::getline(file, line)) {
-            if (line_count++ == 0) continue;
-            auto entry = parse_csv_line(line);
-            if (name_filer_active && !should_load(entry.name)) break;
-            loaded_data_.push_back(entry);
-            if (line_count > batch_size) break;
+    // Split the rows into one block per thread, cutting only at line ends.
+    auto chunk_count = std::max<std::size_t>(1, std::min<std::size_t>(pool.size(), (end - body) / (2 * width + 1)));
+    std::vector<char const*> bounds = {body};
+    for (std::size_t c = 1; c < chunk_count; c++) {
+        auto const* cut = std::max(bounds.back(), body + (end - body) * c / chunk_count);
+        cut = std::find(cut, end, '\n');
+        bounds.push_back(cut == end ? end : cut + 1);
+    }
+    bounds.push_back(end);
+
+    std::vector<Dataset> chunks(chunk_count);
+    pool.parallel_for(chunk_count, [&](std::size_t c) {
+        std::vector<float> pixels(width);
+        for (auto const* line = bounds[c]; line < bounds[c + 1];) {
+            auto const* line_end = std::find(line, bounds[c + 1], '\n');
+            auto row = std::string_view(line, line_end - line);
+            if (!row.empty() && row.back() == '\r') row.remove_suffix(1);
+            if (!row.empty()) chunks[c].push_back(parse_csv_line(row, pixels));
+            line = line_end + 1;
         }
-    } 
+    });
+
+    std::size_t total = 0;
+    for (auto const& chunk: chunks) total += chunk.size();
+    result.reserve(total);
+    for (auto& chunk: chunks) {
+        std::move(chunk.begin(), chunk.end(), std::back_inserter(result));
+    }
+    return result;
 }
 
-Record DataLoader::parse_csv_line(std::string const& line) {
+Record DataLoader::parse_csv_line(std::string_view line, std::vector<float>& pixels) {
     static constexpr char delimiter = ',';
     Record result;
-    auto token_stream = std::istringstream(line);
-    std::string token;
-    unsigned int token_counter = 0;
-    while (std::getline(token_stream, token, delimiter)) {
-        if (++token_counter == 1) {
-            result.name = token;
-            loaded_names_.insert(token);
+    auto name_end = line.find(delimiter);
+    result.name = std::string(line.substr(0, name_end));
+    if (name_end == std::string_view::npos) return result;
+
+    auto const* cursor = line.data() + name_end + 1;
+    auto const* end = line.data() + line.size();
+    std::size_t count = 0;
+    while (cursor < end) {
+        float value;
+        // Binary datasets are nothing but single-digit 0/1 tokens.
+        if ((*cursor == '0' || *cursor == '1') && (cursor + 1 == end || cursor[1] == delimiter)) {
+            value = static_cast<float>(*cursor - '0');
+            cursor++;
+        } else {
+            while (cursor < end && *cursor == ' ') cursor++;
+            auto [next, error] = std::from_chars(cursor, end, value);
+            // The number has to fill the whole token, up to padding spaces
+            // and a '\r' left at the end of the line.
+            while (next < end && *next == ' ') next++;
+            if (next + 1 == end && *next == '\r') next++;
+            if (error != std::errc() || (next != end && *next != delimiter)) {
+                std::cerr << "Invalid pixel value in record: " << result.name << '\n';
+                exit(1);
+            }
+            cursor = next;
+        }
+        if (count == pixels.size()) {
+            pixels.push_back(value);
         } else {
-            result.image.push_back(std::stof(token));
+            pixels[count] = value;
         }
+        count++;
+        cursor++;
     }
+    result.image = PackedImage::from_floats(pixels.data(), count);
     return result;
 }
 
@@ -76,11 +177,134 @@ std::set<std::string> DataLoader::get_names() const{
     return loaded_names_;
 }
 
+std::vector<std::string> const& DataLoader::get_filepaths() const {
+    return csv_filepaths_;
+}
+
+
+DatasetView::DatasetView(Dataset const& data): data_(&data), size_(data.size()) {}
+
+DatasetView::DatasetView(Dataset const* data, std::vector<std::uint32_t> indices):
+    data_(data),
+    size_(indices.size()),
+    indices_(std::move(indices)) {}
 
-std::pair<Dataset, Dataset> split_dataset(Dataset const& data, float split_ratio) {
-    auto split_point = data.begin() + data.size() * split_ratio;
+std::vector<std::uint32_t> DatasetView::all_indices() const {
+    if (!indices_.empty() || size_ == 0) return indices_;
+    std::vector<std::uint32_t> result(size_);
+    std::iota(result.begin(), result.end(), 0);
+    return result;
+}
+
+void DatasetView::shuffle(std::mt19937& rng) {
+    if (indices_.empty()) indices_ = all_indices();
+    std::shuffle(indices_.begin(), indices_.end(), rng);
+}
+
+std::pair<DatasetView, DatasetView> DatasetView::split(float ratio) const {
+    auto indices = all_indices();
+    auto split_point = indices.begin() + static_cast<std::size_t>(size_ * ratio);
     return {
-        {data.begin(), split_point},
-        {split_point, data.end()}
+        DatasetView(data_, {indices.begin(), split_point}),
+        DatasetView(data_, {split_point, indices.end()}),
     };
 }
+
+std::pair<DatasetView, DatasetView> DatasetView::stratified_split(float ratio) const {
+    std::map<std::string, std::size_t> quotas;
+    for (std::size_t i = 0; i < size_; i++) {
+        quotas[(*this)[i].name]++;
+    }
+    for (auto& [name, quota]: quotas) {
+        quota = static_cast<std::size_t>(quota * ratio);
+    }
+    auto indices = all_indices();
+    std::vector<std::uint32_t> first, second;
+    for (std::size_t i = 0; i < size_; i++) {
+        auto& quota = quotas[(*this)[i].name];
+        if (quota > 0) {
+            first.push_back(indices[i]);
+            quota--;
+        } else {
+            second.push_back(indices[i]);
+        }
+    }
+    return {DatasetView(data_, std::move(first)), DatasetView(data_, std::move(second))};
+}
+
+static constexpr float SPARSE_DENSITY_LIMIT = 0.1f;
+
+static void prepare_batch(Batch& batch, std::size_t size, std::size_t image_size, bool sparse) {
+    batch.sparse = sparse;
+    batch.names.resize(size);
+    if (sparse) {
+        batch.active.clear();
+    } else {
+        batch.images.resize(size, image_size);
+    }
+}
+
+static void add_to_batch(Batch& batch, std::size_t b, Record const& record) {
+    if (batch.sparse) {
+        batch.active.add(record.image);
+    } else {
+        record.image.unpack(batch.images.row(b));
+    }
+    batch.names[b] = record.name;
+}
+
+std::size_t batch_count(std::size_t count, std::size_t batch_size) {
+    if (batch_size == 0) {
+        std::cerr << "Batches need at least one image\n";
+        exit(1);
+    }
+    return (count + batch_size - 1) / batch_size;
+}
+
+bool is_sparse_batch(DatasetView const& data, std::size_t first, std::size_t size) {
+    auto image_size = data[first].image.size();
+    std::size_t active = 0;
+    for (std::size_t b = 0; b < size; b++) {
+        auto const& image = data[first + b].image;
+        if (image.format() != PixelFormat::Bit || image.size() != image_size) return false;
+        for (std::size_t w = 0; w < image.word_count(); w++) {
+            active += __builtin_popcountll(image.words()[w]);
+        }
+    }
+    return active <= SPARSE_DENSITY_LIMIT * size * image_size;
+}
+
+void fill_batch(Batch& batch, DatasetView const& data, std::size_t first, std::size_t size, bool sparse) {
+    prepare_batch(batch, size, data[0].image.size(), sparse);
+    for (std::size_t b = 0; b < size; b++) {
+        add_to_batch(batch, b, data[(first + b) % data.size()]);
+    }
+}
+
+bool collect_active_columns(ActiveColumns& columns, DatasetView const& data, std::size_t first, std::size_t size) {
+    auto const& sample = data[first % data.size()].image;
+    auto& used = columns.used;
+    used.assign(sample.word_count(), 0);
+    std::size_t active = 0;
+    for (std::size_t b = 0; b < size; b++) {
+        auto const& image = data[(first + b) % data.size()].image;
+        if (image.format() != PixelFormat::Bit || image.size() != sample.size()) return false;
+        auto const* words = image.words();
+        for (std::size_t w = 0; w < used.size(); w++) {
+            used[w] |= words[w];
+            active += __builtin_popcountll(words[w]);
+        }
+    }
+    if (active > SPARSE_DENSITY_LIMIT * size * sample.size()) return false;
+
+    columns.columns.clear();
+    columns.position.assign(sample.size(), -1);
+    for (std::size_t w = 0; w < used.size(); w++) {
+        for (auto word = used[w]; word != 0; word &= word - 1) {
+            auto pixel = static_cast<std::uint32_t>(w * 64 + __builtin_ctzll(word));
+            columns.position[pixel] = static_cast<std::int32_t>(columns.columns.size());
+            columns.columns.push_back(pixel);
+        }
+    }
+    return true;
+}
@@ -1,37 +1,95 @@
 #pragma once
+#include <cstdint>
+#include <utility>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <set>
 #include <random>
 #include <algorithm>
+#include "matrix.hpp"
+#include "packedImage.hpp"
+#include "preprocess.hpp"
+
+class ThreadPool;
 
 struct Record {
     std::string name;
-    std::vector<float> image;
+    PackedImage image;
 };
 
 using Dataset = std::vector<Record>;
-std::pair<Dataset, Dataset> split_dataset(Dataset const& data, float split_ratio);
+
+// Records of a Dataset picked and ordered by a list of indices, so shuffling
+// and splitting never copy an image. The Dataset must outlive its views. A
+// view of a whole Dataset keeps no indices until it is reordered.
+class DatasetView {
+public:
+    DatasetView() = default;
+    DatasetView(Dataset const& data);
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    Record const& operator[](std::size_t i) const {
+        return (*data_)[indices_.empty() ? i : indices_[i]];
+    }
+
+    void shuffle(std::mt19937& rng);
+    // The first `ratio` of the records and the rest.
+    std::pair<DatasetView, DatasetView> split(float ratio) const;
+    // Same, but `ratio` of every class goes to the first part. Both keep the
+    // view's order.
+    std::pair<DatasetView, DatasetView> stratified_split(float ratio) const;
+
+private:
+    Dataset const* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::vector<std::uint32_t> indices_;
+
+    DatasetView(Dataset const* data, std::vector<std::uint32_t> indices);
+    std::vector<std::uint32_t> all_indices() const;
+};
+
+// A sparse batch carries only the active pixel lists of its binary images and
+// leaves `images` untouched.
+struct Batch {
+    Matrix images;
+    ActivePixels active;
+    bool sparse = false;
+    std::vector<std::string> names;
+};
+
+// Batches of `batch_size` needed for `count` records. Exits when batch_size is 0.
+std::size_t batch_count(std::size_t count, std::size_t batch_size);
+// Gathers `size` records starting at `first` (wrapping around) into one image matrix.
+void fill_batch(Batch& batch, DatasetView const& data, std::size_t first, std::size_t size, bool sparse = false);
+// True when the same records are binary and sparse enough for the sparse first layer.
+bool is_sparse_batch(DatasetView const& data, std::size_t first, std::size_t size);
+// Collects the union of active pixels of the same records. Returns false when
+// the batch is not binary or too dense for the sparse path to pay off.
+bool collect_active_columns(ActiveColumns& columns, DatasetView const& data, std::size_t first, std::size_t size);
 
 
 class DataLoader {
 public:
     DataLoader(std::string const& data_dir);
-    void load(unsigned int batch_size = 1000, std::vector<std::string> const& names = {});
+    // CSV files without an up-to-date cache are parsed on `threads` threads
+    // (0 = one per core), each taking a contiguous block of lines.
+    void load(unsigned int batch_size = 1000, std::vector<std::string> const& names = {}, std::size_t threads = 0);
+    // Applied by load() to every record it keeps, on the same threads.
+    void set_preprocessing(Preprocessing preprocessing);
     Dataset const& get_data() const;
-
-    static Dataset shuffle_data(Dataset const& orignal) {
-        auto data = orignal;
-        std::random_device rd;
-        auto g = std::mt19937(rd());
-        std::shuffle(data.begin(), data.end(), g);
-        return data;
-    }
     std::set<std::string> get_names() const;
+    std::vector<std::string> const& get_filepaths() const;
+
+    // Parses one "name,p0,p1,..." row. `pixels` is scratch space, reused
+    // between calls; sizing it to the header width avoids regrowing it.
+    static Record parse_csv_line(std::string_view line, std::vector<float>& pixels);
+    static Dataset parse_csv_file(std::string const& path, ThreadPool& pool);
 
 private:
     std::vector<std::string> csv_filepaths_;
     Dataset loaded_data_;
     std::set<std::string> loaded_names_;
-    Record parse_csv_line(std::string const& line);
+    Preprocessing preprocessing_;
 };
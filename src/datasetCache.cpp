@@ -0,0 +1,193 @@
+#include "datasetCache.hpp"
+#include "mappedFile.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+static constexpr char DATASET_CACHE_MAGIC[8] = {'N', 'N', 'N', 'D', 'A', 'T', 'A', '\0'};
+static constexpr std::size_t DATASET_CACHE_ALIGNMENT = 64;
+
+static std::size_t align_up(std::size_t value) {
+    return (value + DATASET_CACHE_ALIGNMENT - 1) / DATASET_CACHE_ALIGNMENT * DATASET_CACHE_ALIGNMENT;
+}
+
+static bool source_stamp(std::string const& source_path, std::uint64_t& size, std::int64_t& mtime) {
+    std::error_code error;
+    size = std::filesystem::file_size(source_path, error);
+    if (error) return false;
+    auto time = std::filesystem::last_write_time(source_path, error);
+    if (error) return false;
+    mtime = static_cast<std::int64_t>(time.time_since_epoch().count());
+    return true;
+}
+
+// offset + count * item_size <= size, in a form that cannot overflow.
+static bool fits(std::uint64_t offset, std::uint64_t count, std::uint64_t item_size, std::size_t size) {
+    return offset <= size && (item_size == 0 || count <= (size - offset) / item_size);
+}
+
+std::string dataset_cache_path(std::string const& csv_path) {
+    auto path = std::filesystem::path(csv_path);
+    return (path.parent_path() / "cache" / path.stem()).string() + ".bin";
+}
+
+bool DatasetCacheReader::open(std::string const& cache_path, std::string const& source_path) {
+    mapping_.reset();
+    labels_.clear();
+    std::uint64_t source_size;
+    std::int64_t source_mtime;
+    if (!source_stamp(source_path, source_size, source_mtime)) return false;
+
+    auto mapping = MappedFile::open(cache_path);
+    if (!mapping || mapping->size() < sizeof(DatasetCacheHeader)) return false;
+    mapping->advise_sequential();
+    auto const* base = mapping->data();
+    auto size = mapping->size();
+
+    DatasetCacheHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    auto format = static_cast<PixelFormat>(header.pixel_format);
+    if (std::memcmp(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != DATASET_CACHE_VERSION
+        || header.source_size != source_size
+        || header.source_mtime != source_mtime
+        || (format != PixelFormat::Bit && format != PixelFormat::Byte)
+        || header.record_stride != PackedImage::word_count(format, header.pixel_count) * sizeof(std::uint64_t)
+        || header.pixels_offset % alignof(std::uint64_t) != 0
+        || !fits(header.pixels_offset, header.record_count, header.record_stride, size)
+        || header.record_labels_offset % alignof(std::uint32_t) != 0
+        || !fits(header.record_labels_offset, header.record_count, sizeof(std::uint32_t), size)
+        || header.labels_offset > size) {
+        return false;
+    }
+
+    // A truncated or corrupt table makes the cache unreadable, not the loader crash.
+    auto position = header.labels_offset;
+    for (std::uint32_t l = 0; l < header.label_count; l++) {
+        std::uint32_t length;
+        if (!fits(position, 1, sizeof(length), size)) return false;
+        std::memcpy(&length, base + position, sizeof(length));
+        position += sizeof(length);
+        if (!fits(position, 1, length, size)) return false;
+        labels_.emplace_back(base + position, length);
+        position += length;
+    }
+
+    auto const* record_labels = reinterpret_cast<std::uint32_t const*>(base + header.record_labels_offset);
+    for (std::uint64_t r = 0; r < header.record_count; r++) {
+        if (record_labels[r] >= labels_.size()) return false;
+    }
+
+    header_ = header;
+    record_labels_ = record_labels;
+    mapping_ = std::move(mapping);
+    return true;
+}
+
+std::string const& DatasetCacheReader::name(std::size_t index) const {
+    return labels_[record_labels_[index]];
+}
+
+Record DatasetCacheReader::read(std::size_t index) const {
+    auto const* words = reinterpret_cast<std::uint64_t const*>(
+        mapping_->data() + header_.pixels_offset + index * header_.record_stride
+    );
+    auto format = static_cast<PixelFormat>(header_.pixel_format);
+    return Record{name(index), PackedImage(format, header_.pixel_count, words)};
+}
+
+bool read_dataset_cache(
+    std::string const& cache_path,
+    std::string const& source_path,
+    std::function<bool(Record&&)> const& visit
+) {
+    DatasetCacheReader reader;
+    if (!reader.open(cache_path, source_path)) return false;
+    for (std::size_t r = 0; r < reader.size(); r++) {
+        if (!visit(reader.read(r))) break;
+    }
+    return true;
+}
+
+bool write_dataset_cache(std::string const& cache_path, std::string const& source_path, Dataset const& records) {
+    DatasetCacheHeader header = {};
+    std::memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_CACHE_VERSION;
+    if (!source_stamp(source_path, header.source_size, header.source_mtime)) return false;
+
+    auto pixel_count = records.empty() ? 0 : records[0].image.size();
+    auto format = PixelFormat::Bit;
+    for (auto const& record: records) {
+        if (record.image.size() != pixel_count) {
+            std::cerr << "Not caching " << source_path << ": images differ in size\n";
+            return false;
+        }
+        if (record.image.format() == PixelFormat::Byte) format = PixelFormat::Byte;
+    }
+
+    std::string label_table;
+    std::map<std::string, std::uint32_t> label_index;
+    std::vector<std::uint32_t> record_labels;
+    for (auto const& record: records) {
+        auto [it, inserted] = label_index.insert({record.name, static_cast<std::uint32_t>(label_index.size())});
+        if (inserted) {
+            auto length = static_cast<std::uint32_t>(record.name.size());
+            label_table.append(reinterpret_cast<char const*>(&length), sizeof(length));
+            label_table += record.name;
+        }
+        record_labels.push_back(it->second);
+    }
+
+    header.pixel_format = static_cast<std::uint32_t>(format);
+    header.record_count = records.size();
+    header.pixel_count = pixel_count;
+    header.label_count = static_cast<std::uint32_t>(label_index.size());
+    header.labels_offset = align_up(sizeof(header));
+    header.record_labels_offset = align_up(header.labels_offset + label_table.size());
+    header.pixels_offset = align_up(header.record_labels_offset + record_labels.size() * sizeof(std::uint32_t));
+    header.record_stride = PackedImage::word_count(format, pixel_count) * sizeof(std::uint64_t);
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(cache_path).parent_path(), error);
+    auto temp_path = cache_path + ".tmp";
+    auto file = std::ofstream(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Unable to write dataset cache: " << cache_path << '\n';
+        return false;
+    }
+
+    auto pad_to = [&](std::uint64_t offset) {
+        auto position = static_cast<std::uint64_t>(file.tellp());
+        file.write(std::string(offset - position, '\0').data(), offset - position);
+    };
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    pad_to(header.labels_offset);
+    file.write(label_table.data(), label_table.size());
+    pad_to(header.record_labels_offset);
+    file.write(reinterpret_cast<char const*>(record_labels.data()), record_labels.size() * sizeof(std::uint32_t));
+    pad_to(header.pixels_offset);
+
+    for (auto const& record: records) {
+        auto const* image = &record.image;
+        PackedImage converted;
+        if (image->format() != format) {
+            converted = PackedImage(format, pixel_count);
+            for (std::size_t i = 0; i < pixel_count; i++) {
+                converted.set(i, record.image[i]);
+            }
+            image = &converted;
+        }
+        file.write(reinterpret_cast<char const*>(image->words()), header.record_stride);
+    }
+
+    file.close();
+    if (!file) {
+        std::cerr << "Unable to write dataset cache: " << cache_path << '\n';
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    std::filesystem::rename(temp_path, cache_path, error);
+    return !error;
+}
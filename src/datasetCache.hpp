@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include "dataLoader.hpp"
+
+class MappedFile;
+
+// Binary image cache built once from a CSV file:
+//   DatasetCacheHeader    source size/mtime, record count, pixel format
+//   label table           (name length, name bytes) per distinct label
+//   record labels         uint32 label index per record
+//   pixel planes          record_stride bytes per record, 64-byte aligned
+// A cache whose recorded source size or mtime differ from the CSV is stale.
+constexpr std::uint32_t DATASET_CACHE_VERSION = 1;
+
+struct DatasetCacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t pixel_format;
+    std::uint64_t record_count;
+    std::uint64_t pixel_count;
+    std::uint64_t source_size;
+    std::int64_t source_mtime;
+    std::uint32_t label_count;
+    std::uint32_t reserved;
+    std::uint64_t labels_offset;
+    std::uint64_t record_labels_offset;
+    std::uint64_t pixels_offset;
+    std::uint64_t record_stride;
+};
+
+// Random access to the records of a mapped cache file.
+class DatasetCacheReader {
+public:
+    // Returns false when the cache is missing, stale or unreadable.
+    bool open(std::string const& cache_path, std::string const& source_path);
+    bool is_open() const { return mapping_ != nullptr; }
+    std::size_t size() const { return is_open() ? header_.record_count : 0; }
+    std::string const& name(std::size_t index) const;
+    Record read(std::size_t index) const;
+
+private:
+    std::shared_ptr<MappedFile> mapping_;
+    DatasetCacheHeader header_ = {};
+    std::vector<std::string> labels_;
+    std::uint32_t const* record_labels_ = nullptr;
+};
+
+std::string dataset_cache_path(std::string const& csv_path);
+// Calls `visit` for cached records in file order until it returns false.
+// Returns false when the cache is missing, stale or unreadable.
+bool read_dataset_cache(
+    std::string const& cache_path,
+    std::string const& source_path,
+    std::function<bool(Record&&)> const& visit
+);
+bool write_dataset_cache(std::string const& cache_path, std::string const& source_path, Dataset const& records);
@@ -0,0 +1,1226 @@
+#include "kernels.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace kernels {
+
+namespace {
+
+struct HalfKernels {
+    float (*dot)(float const*, std::uint16_t const*, std::size_t);
+    float (*gather_sum)(std::uint16_t const*, std::uint32_t const*, std::size_t);
+    void (*to_half)(float const*, std::uint16_t*, std::size_t);
+    void (*from_half)(std::uint16_t const*, float*, std::size_t);
+};
+
+struct KernelTable {
+    Isa isa;
+    float (*dot)(float const*, float const*, std::size_t);
+    void (*axpy)(float, float const*, float*, std::size_t);
+    void (*update)(UpdateParams const&, float*, float*, float*, float const*, std::size_t);
+    float (*gather_sum)(float const*, std::uint32_t const*, std::size_t);
+    void (*sum_rows)(float const*, std::size_t, std::uint32_t const*, std::size_t, float*, std::size_t);
+    void (*relu)(float*, std::size_t);
+    void (*sigmoid)(float*, std::size_t);
+    std::int32_t (*dot_u8s8)(std::uint8_t const*, std::int8_t const*, std::size_t);
+    void (*axpy_s8)(std::int32_t, std::int8_t const*, std::int32_t*, std::size_t);
+    char const* int8_name;
+    HalfKernels bf16;
+    HalfKernels fp16;
+};
+
+float dot_scalar(float const* x, float const* y, std::size_t n) {
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; i++) {
+        sum += x[i] * y[i];
+    }
+    return sum;
+}
+
+void axpy_scalar(float alpha, float const* x, float* y, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+float gather_sum_scalar(float const* x, std::uint32_t const* indices, std::size_t n) {
+    float sum = 0.0f;
+    for (std::size_t k = 0; k < n; k++) {
+        sum += x[indices[k]];
+    }
+    return sum;
+}
+
+void sum_rows_scalar(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n) {
+    for (std::size_t k = 0; k < count; k++) {
+        auto const* row = x + indices[k] * stride;
+        for (std::size_t i = 0; i < n; i++) {
+            y[i] += row[i];
+        }
+    }
+}
+
+void relu_scalar(float* x, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        x[i] = std::max(x[i], 0.0f);
+    }
+}
+
+void update_scalar(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n) {
+    switch (params.rule) {
+        case UpdateRule::Sgd:
+            axpy_scalar(-params.rate, g, w, n);
+            break;
+        case UpdateRule::Momentum:
+            for (std::size_t i = 0; i < n; i++) momentum_step(params, w[i], m[i], g[i]);
+            break;
+        case UpdateRule::Nesterov:
+            for (std::size_t i = 0; i < n; i++) nesterov_step(params, w[i], m[i], g[i]);
+            break;
+        case UpdateRule::Adam:
+            for (std::size_t i = 0; i < n; i++) adam_step(params, w[i], m[i], v[i], g[i]);
+            break;
+    }
+}
+
+void sigmoid_scalar(float* x, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        x[i] = fast_sigmoid(x[i]);
+    }
+}
+
+std::int32_t dot_u8s8_scalar(std::uint8_t const* x, std::int8_t const* y, std::size_t n) {
+    std::int32_t sum = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        sum += static_cast<std::int32_t>(x[i]) * y[i];
+    }
+    return sum;
+}
+
+void axpy_s8_scalar(std::int32_t alpha, std::int8_t const* x, std::int32_t* y, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+std::uint16_t float_to_bf16(float x) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) return static_cast<std::uint16_t>((bits >> 16) | 0x40);
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return static_cast<std::uint16_t>(bits >> 16);
+}
+
+float bf16_to_float(std::uint16_t x) {
+    auto bits = static_cast<std::uint32_t>(x) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+std::uint16_t float_to_fp16(float x) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    auto sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000);
+    auto magnitude = bits & 0x7FFFFFFF;
+    if (magnitude > 0x7F800000) return sign | 0x7E00;
+    if (magnitude >= 0x477FF000) return sign | 0x7C00;    // rounds past 65504: infinity
+    if (magnitude < 0x38800000) {
+        // Subnormal half: shift the mantissa (with its implicit bit) into place.
+        if (magnitude < 0x33000000) return sign;
+        auto exponent = magnitude >> 23;
+        auto mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        auto shift = 126 - exponent;
+        auto half = mantissa >> shift;
+        auto rest = mantissa & ((1u << shift) - 1);
+        auto halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | static_cast<std::uint16_t>(half);
+    }
+    magnitude -= 0x38000000;
+    magnitude += 0xFFF + ((magnitude >> 13) & 1);
+    return sign | static_cast<std::uint16_t>(magnitude >> 13);
+}
+
+float fp16_to_float(std::uint16_t x) {
+    std::uint32_t sign = (x & 0x8000u) << 16;
+    std::uint32_t exponent = (x >> 10) & 0x1F;
+    std::uint32_t mantissa = x & 0x3FF;
+    std::uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+template<float (*Widen)(std::uint16_t)>
+float dot_half_scalar(float const* x, std::uint16_t const* y, std::size_t n) {
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; i++) {
+        sum += x[i] * Widen(y[i]);
+    }
+    return sum;
+}
+
+template<float (*Widen)(std::uint16_t)>
+float gather_sum_half_scalar(std::uint16_t const* x, std::uint32_t const* indices, std::size_t n) {
+    float sum = 0.0f;
+    for (std::size_t k = 0; k < n; k++) {
+        sum += Widen(x[indices[k]]);
+    }
+    return sum;
+}
+
+template<std::uint16_t (*Narrow)(float)>
+void to_half_scalar(float const* x, std::uint16_t* y, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        y[i] = Narrow(x[i]);
+    }
+}
+
+template<float (*Widen)(std::uint16_t)>
+void from_half_scalar(std::uint16_t const* x, float* y, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        y[i] = Widen(x[i]);
+    }
+}
+
+constexpr HalfKernels BF16_SCALAR = {
+    dot_half_scalar<bf16_to_float>,
+    gather_sum_half_scalar<bf16_to_float>,
+    to_half_scalar<float_to_bf16>,
+    from_half_scalar<bf16_to_float>,
+};
+
+constexpr HalfKernels FP16_SCALAR = {
+    dot_half_scalar<fp16_to_float>,
+    gather_sum_half_scalar<fp16_to_float>,
+    to_half_scalar<float_to_fp16>,
+    from_half_scalar<fp16_to_float>,
+};
+
+#ifdef KERNELS_X86
+
+float hsum(__m128 v) {
+    auto shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    auto sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+__attribute__((target("sse2")))
+float dot_sse2(float const* x, float const* y, std::size_t n) {
+    auto acc0 = _mm_setzero_ps();
+    auto acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4)));
+    }
+    float sum = hsum(_mm_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        sum += x[i] * y[i];
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+void axpy_sse2(float alpha, float const* x, float* y, std::size_t n) {
+    auto a = _mm_set1_ps(alpha);
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("sse2")))
+void relu_sse2(float* x, std::size_t n) {
+    auto zero = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(x + i, _mm_max_ps(_mm_loadu_ps(x + i), zero));
+    }
+    for (; i < n; i++) {
+        x[i] = std::max(x[i], 0.0f);
+    }
+}
+
+__attribute__((target("sse2")))
+void update_sse2(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n) {
+    if (params.rule == UpdateRule::Sgd) {
+        axpy_sse2(-params.rate, g, w, n);
+        return;
+    }
+    auto rate = _mm_set1_ps(params.rate);
+    auto beta1 = _mm_set1_ps(params.beta1);
+    std::size_t i = 0;
+    if (params.rule == UpdateRule::Adam) {
+        auto gain1 = _mm_set1_ps(1.0f - params.beta1);
+        auto beta2 = _mm_set1_ps(params.beta2);
+        auto gain2 = _mm_set1_ps(1.0f - params.beta2);
+        auto epsilon = _mm_set1_ps(params.epsilon);
+        for (; i + 4 <= n; i += 4) {
+            auto grad = _mm_loadu_ps(g + i);
+            auto m1 = _mm_add_ps(_mm_mul_ps(beta1, _mm_loadu_ps(m + i)), _mm_mul_ps(gain1, grad));
+            auto m2 = _mm_add_ps(_mm_mul_ps(beta2, _mm_loadu_ps(v + i)), _mm_mul_ps(gain2, _mm_mul_ps(grad, grad)));
+            auto step = _mm_div_ps(m1, _mm_add_ps(_mm_sqrt_ps(m2), epsilon));
+            _mm_storeu_ps(m + i, m1);
+            _mm_storeu_ps(v + i, m2);
+            _mm_storeu_ps(w + i, _mm_sub_ps(_mm_loadu_ps(w + i), _mm_mul_ps(rate, step)));
+        }
+        for (; i < n; i++) adam_step(params, w[i], m[i], v[i], g[i]);
+        return;
+    }
+    bool nesterov = params.rule == UpdateRule::Nesterov;
+    for (; i + 4 <= n; i += 4) {
+        auto grad = _mm_loadu_ps(g + i);
+        auto m1 = _mm_add_ps(_mm_mul_ps(beta1, _mm_loadu_ps(m + i)), grad);
+        auto step = nesterov ? _mm_add_ps(_mm_mul_ps(beta1, m1), grad) : m1;
+        _mm_storeu_ps(m + i, m1);
+        _mm_storeu_ps(w + i, _mm_sub_ps(_mm_loadu_ps(w + i), _mm_mul_ps(rate, step)));
+    }
+    for (; i < n; i++) {
+        if (nesterov) {
+            nesterov_step(params, w[i], m[i], g[i]);
+        } else {
+            momentum_step(params, w[i], m[i], g[i]);
+        }
+    }
+}
+
+// Eight accumulators cover 32 outputs per pass over the indices.
+__attribute__((target("sse2")))
+void sum_rows_sse2(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m128 acc[8];
+        for (std::size_t v = 0; v < 8; v++) {
+            acc[v] = _mm_loadu_ps(y + i + v * 4);
+        }
+        for (std::size_t k = 0; k < count; k++) {
+            auto const* row = x + indices[k] * stride + i;
+            for (std::size_t v = 0; v < 8; v++) {
+                acc[v] = _mm_add_ps(acc[v], _mm_loadu_ps(row + v * 4));
+            }
+        }
+        for (std::size_t v = 0; v < 8; v++) {
+            _mm_storeu_ps(y + i + v * 4, acc[v]);
+        }
+    }
+    if (i < n) {
+        sum_rows_scalar(x + i, stride, indices, count, y + i, n - i);
+    }
+}
+
+// fast_exp as in exp_avx2, without fma; SSE2 has no floor, so it is
+// rebuilt from a truncating conversion.
+__attribute__((target("sse2")))
+inline __m128 exp_sse2(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.0f));
+    auto t = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f));
+    auto truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    auto n = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, t), _mm_set1_ps(1.0f)));
+    auto r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    r = _mm_add_ps(r, _mm_mul_ps(n, _mm_set1_ps(2.12194440e-4f)));
+    auto p = _mm_set1_ps(1.9875691500e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+    auto e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), r), _mm_set1_ps(1.0f));
+    auto scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(e, _mm_castsi128_ps(scale));
+}
+
+__attribute__((target("sse2")))
+void sigmoid_sse2(float* x, std::size_t n) {
+    auto one = _mm_set1_ps(1.0f);
+    auto sign = _mm_set1_ps(-0.0f);
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto e = exp_sse2(_mm_xor_ps(_mm_loadu_ps(x + i), sign));
+        _mm_storeu_ps(x + i, _mm_div_ps(one, _mm_add_ps(one, e)));
+    }
+    sigmoid_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+float dot_avx2(float const* x, float const* y, std::size_t n) {
+    auto acc0 = _mm256_setzero_ps();
+    auto acc1 = _mm256_setzero_ps();
+    auto acc2 = _mm256_setzero_ps();
+    auto acc3 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 16), _mm256_loadu_ps(y + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 24), _mm256_loadu_ps(y + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    }
+    auto acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    float sum = hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < n; i++) {
+        sum += x[i] * y[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+void axpy_avx2(float alpha, float const* x, float* y, std::size_t n) {
+    auto a = _mm256_set1_ps(alpha);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+    }
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void update_avx2(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n) {
+    if (params.rule == UpdateRule::Sgd) {
+        axpy_avx2(-params.rate, g, w, n);
+        return;
+    }
+    auto rate = _mm256_set1_ps(-params.rate);
+    auto beta1 = _mm256_set1_ps(params.beta1);
+    std::size_t i = 0;
+    if (params.rule == UpdateRule::Adam) {
+        auto gain1 = _mm256_set1_ps(1.0f - params.beta1);
+        auto beta2 = _mm256_set1_ps(params.beta2);
+        auto gain2 = _mm256_set1_ps(1.0f - params.beta2);
+        auto epsilon = _mm256_set1_ps(params.epsilon);
+        for (; i + 8 <= n; i += 8) {
+            auto grad = _mm256_loadu_ps(g + i);
+            auto m1 = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), _mm256_mul_ps(gain1, grad));
+            auto m2 = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i), _mm256_mul_ps(gain2, _mm256_mul_ps(grad, grad)));
+            auto step = _mm256_div_ps(m1, _mm256_add_ps(_mm256_sqrt_ps(m2), epsilon));
+            _mm256_storeu_ps(m + i, m1);
+            _mm256_storeu_ps(v + i, m2);
+            _mm256_storeu_ps(w + i, _mm256_fmadd_ps(rate, step, _mm256_loadu_ps(w + i)));
+        }
+        for (; i < n; i++) adam_step(params, w[i], m[i], v[i], g[i]);
+        return;
+    }
+    bool nesterov = params.rule == UpdateRule::Nesterov;
+    for (; i + 8 <= n; i += 8) {
+        auto grad = _mm256_loadu_ps(g + i);
+        auto m1 = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), grad);
+        auto step = nesterov ? _mm256_fmadd_ps(beta1, m1, grad) : m1;
+        _mm256_storeu_ps(m + i, m1);
+        _mm256_storeu_ps(w + i, _mm256_fmadd_ps(rate, step, _mm256_loadu_ps(w + i)));
+    }
+    for (; i < n; i++) {
+        if (nesterov) {
+            nesterov_step(params, w[i], m[i], g[i]);
+        } else {
+            momentum_step(params, w[i], m[i], g[i]);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+float gather_sum_avx2(float const* x, std::uint32_t const* indices, std::size_t n) {
+    auto acc0 = _mm256_setzero_ps();
+    auto acc1 = _mm256_setzero_ps();
+    std::size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        auto idx0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + k));
+        auto idx1 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + k + 8));
+        acc0 = _mm256_add_ps(acc0, _mm256_i32gather_ps(x, idx0, 4));
+        acc1 = _mm256_add_ps(acc1, _mm256_i32gather_ps(x, idx1, 4));
+    }
+    auto acc = _mm256_add_ps(acc0, acc1);
+    float sum = hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; k < n; k++) {
+        sum += x[indices[k]];
+    }
+    return sum;
+}
+
+// Eight accumulators cover 64 outputs per pass over the indices.
+__attribute__((target("avx2")))
+void sum_rows_avx2(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256 acc[8];
+        for (std::size_t v = 0; v < 8; v++) {
+            acc[v] = _mm256_loadu_ps(y + i + v * 8);
+        }
+        for (std::size_t k = 0; k < count; k++) {
+            auto const* row = x + indices[k] * stride + i;
+            for (std::size_t v = 0; v < 8; v++) {
+                acc[v] = _mm256_add_ps(acc[v], _mm256_loadu_ps(row + v * 8));
+            }
+        }
+        for (std::size_t v = 0; v < 8; v++) {
+            _mm256_storeu_ps(y + i + v * 8, acc[v]);
+        }
+    }
+    if (i < n) {
+        sum_rows_scalar(x + i, stride, indices, count, y + i, n - i);
+    }
+}
+
+__attribute__((target("avx2")))
+void relu_avx2(float* x, std::size_t n) {
+    auto zero = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_max_ps(_mm256_loadu_ps(x + i), zero));
+    }
+    for (; i < n; i++) {
+        x[i] = std::max(x[i], 0.0f);
+    }
+}
+
+// fast_exp with the exponent built directly in the float bits.
+__attribute__((target("avx2,fma")))
+inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+    auto n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504f), _mm256_set1_ps(0.5f)));
+    auto r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fmadd_ps(n, _mm256_set1_ps(2.12194440e-4f), r);
+    auto p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    auto e = _mm256_add_ps(_mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.0f));
+    auto scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(e, _mm256_castsi256_ps(scale));
+}
+
+__attribute__((target("avx2,fma")))
+void sigmoid_avx2(float* x, std::size_t n) {
+    auto one = _mm256_set1_ps(1.0f);
+    auto sign = _mm256_set1_ps(-0.0f);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto e = exp_avx2(_mm256_xor_ps(_mm256_loadu_ps(x + i), sign));
+        _mm256_storeu_ps(x + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+    }
+    sigmoid_scalar(x + i, n - i);
+}
+
+// maddubs adds two u8*s8 products into a saturating int16, which cannot
+// overflow as long as x stays within [0, 127].
+__attribute__((target("avx2")))
+std::int32_t dot_u8s8_avx2(std::uint8_t const* x, std::int8_t const* y, std::size_t n) {
+    auto ones = _mm256_set1_epi16(1);
+    auto acc0 = _mm256_setzero_si256();
+    auto acc1 = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        auto x0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i));
+        auto y0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i));
+        auto x1 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i + 32));
+        auto y1 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i + 32));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(x0, y0), ones));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_maddubs_epi16(x1, y1), ones));
+    }
+    for (; i + 32 <= n; i += 32) {
+        auto x0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i));
+        auto y0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(x0, y0), ones));
+    }
+    auto acc = _mm256_add_epi32(acc0, acc1);
+    alignas(32) std::int32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    std::int32_t sum = 0;
+    for (auto lane: lanes) {
+        sum += lane;
+    }
+    for (; i < n; i++) {
+        sum += static_cast<std::int32_t>(x[i]) * y[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+void axpy_s8_avx2(std::int32_t alpha, std::int8_t const* x, std::int32_t* y, std::size_t n) {
+    auto a = _mm256_set1_epi32(alpha);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto wide = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(x + i)));
+        auto* out = reinterpret_cast<__m256i*>(y + i);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), _mm256_mullo_epi32(a, wide)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx512f")))
+void axpy_s8_avx512(std::int32_t alpha, std::int8_t const* x, std::int32_t* y, std::size_t n) {
+    auto a = _mm512_set1_epi32(alpha);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto wide = _mm512_maskz_cvtepi8_epi32(0xFFFF, _mm_loadu_si128(reinterpret_cast<__m128i const*>(x + i)));
+        _mm512_storeu_si512(y + i, _mm512_add_epi32(_mm512_loadu_si512(y + i), _mm512_mullo_epi32(a, wide)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+std::int32_t dot_u8s8_vnni(std::uint8_t const* x, std::int8_t const* y, std::size_t n) {
+    auto acc0 = _mm512_setzero_si512();
+    auto acc1 = _mm512_setzero_si512();
+    std::size_t i = 0;
+    for (; i + 128 <= n; i += 128) {
+        acc0 = _mm512_dpbusd_epi32(acc0, _mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+        acc1 = _mm512_dpbusd_epi32(acc1, _mm512_loadu_si512(x + i + 64), _mm512_loadu_si512(y + i + 64));
+    }
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_dpbusd_epi32(acc0, _mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+    }
+    if (i < n) {
+        auto mask = static_cast<__mmask64>((~0ull) >> (64 - (n - i)));
+        acc1 = _mm512_dpbusd_epi32(acc1, _mm512_maskz_loadu_epi8(mask, x + i), _mm512_maskz_loadu_epi8(mask, y + i));
+    }
+    alignas(64) std::int32_t lanes[16];
+    _mm512_store_si512(lanes, _mm512_add_epi32(acc0, acc1));
+    std::int32_t sum = 0;
+    for (auto lane: lanes) {
+        sum += lane;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+float dot_avx512(float const* x, float const* y, std::size_t n) {
+    auto acc0 = _mm512_setzero_ps();
+    auto acc1 = _mm512_setzero_ps();
+    auto acc2 = _mm512_setzero_ps();
+    auto acc3 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 32), _mm512_loadu_ps(y + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 48), _mm512_loadu_ps(y + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+    }
+    if (i < n) {
+        auto mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), acc1);
+    }
+    auto acc = _mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3));
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, acc);
+    float sum = 0.0f;
+    for (float lane: lanes) {
+        sum += lane;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+void axpy_avx512(float alpha, float const* x, float* y, std::size_t n) {
+    auto a = _mm512_set1_ps(alpha);
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+        _mm512_storeu_ps(y + i + 16, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16)));
+    }
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    if (i < n) {
+        auto mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+        auto result = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+        _mm512_mask_storeu_ps(y + i, mask, result);
+    }
+}
+
+// Full vectors and the tail share one body: the mask only trims the last one.
+__attribute__((target("avx512f")))
+void update_avx512(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n) {
+    if (params.rule == UpdateRule::Sgd) {
+        axpy_avx512(-params.rate, g, w, n);
+        return;
+    }
+    auto rate = _mm512_set1_ps(-params.rate);
+    auto beta1 = _mm512_set1_ps(params.beta1);
+    if (params.rule == UpdateRule::Adam) {
+        auto gain1 = _mm512_set1_ps(1.0f - params.beta1);
+        auto beta2 = _mm512_set1_ps(params.beta2);
+        auto gain2 = _mm512_set1_ps(1.0f - params.beta2);
+        auto epsilon = _mm512_set1_ps(params.epsilon);
+        for (std::size_t i = 0; i < n; i += 16) {
+            auto mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - i)) - 1);
+            auto grad = _mm512_maskz_loadu_ps(mask, g + i);
+            auto m1 = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, m + i), _mm512_mul_ps(gain1, grad));
+            auto m2 = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(mask, v + i), _mm512_mul_ps(gain2, _mm512_mul_ps(grad, grad)));
+            auto step = _mm512_div_ps(m1, _mm512_add_ps(_mm512_maskz_sqrt_ps(mask, m2), epsilon));
+            _mm512_mask_storeu_ps(m + i, mask, m1);
+            _mm512_mask_storeu_ps(v + i, mask, m2);
+            _mm512_mask_storeu_ps(w + i, mask, _mm512_fmadd_ps(rate, step, _mm512_maskz_loadu_ps(mask, w + i)));
+        }
+        return;
+    }
+    bool nesterov = params.rule == UpdateRule::Nesterov;
+    for (std::size_t i = 0; i < n; i += 16) {
+        auto mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - i)) - 1);
+        auto grad = _mm512_maskz_loadu_ps(mask, g + i);
+        auto m1 = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, m + i), grad);
+        auto step = nesterov ? _mm512_fmadd_ps(beta1, m1, grad) : m1;
+        _mm512_mask_storeu_ps(m + i, mask, m1);
+        _mm512_mask_storeu_ps(w + i, mask, _mm512_fmadd_ps(rate, step, _mm512_maskz_loadu_ps(mask, w + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+float gather_sum_avx512(float const* x, std::uint32_t const* indices, std::size_t n) {
+    auto acc0 = _mm512_setzero_ps();
+    auto acc1 = _mm512_setzero_ps();
+    std::size_t k = 0;
+    for (; k + 32 <= n; k += 32) {
+        auto idx0 = _mm512_loadu_si512(indices + k);
+        auto idx1 = _mm512_loadu_si512(indices + k + 16);
+        acc0 = _mm512_add_ps(acc0, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, idx0, x, 4));
+        acc1 = _mm512_add_ps(acc1, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, idx1, x, 4));
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+    float sum = 0.0f;
+    for (float lane: lanes) {
+        sum += lane;
+    }
+    for (; k < n; k++) {
+        sum += x[indices[k]];
+    }
+    return sum;
+}
+
+// Eight accumulators cover 128 outputs per pass over the indices; masks trim
+// the last pass, so any n takes the same path.
+__attribute__((target("avx512f")))
+void sum_rows_avx512(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n) {
+    for (std::size_t i = 0; i < n; i += 128) {
+        __m512 acc[8];
+        __mmask16 masks[8];
+        for (std::size_t v = 0; v < 8; v++) {
+            auto first = i + v * 16;
+            masks[v] = first >= n ? 0 : n - first >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - first)) - 1);
+            acc[v] = _mm512_maskz_loadu_ps(masks[v], y + first);
+        }
+        for (std::size_t k = 0; k < count; k++) {
+            auto const* row = x + indices[k] * stride + i;
+            for (std::size_t v = 0; v < 8; v++) {
+                acc[v] = _mm512_add_ps(acc[v], _mm512_maskz_loadu_ps(masks[v], row + v * 16));
+            }
+        }
+        for (std::size_t v = 0; v < 8; v++) {
+            _mm512_mask_storeu_ps(y + i + v * 16, masks[v], acc[v]);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void relu_avx512(float* x, std::size_t n) {
+    auto zero = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(x + i, _mm512_maskz_max_ps(0xFFFF, _mm512_loadu_ps(x + i), zero));
+    }
+    if (i < n) {
+        auto mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(x + i, mask, _mm512_maskz_max_ps(mask, _mm512_maskz_loadu_ps(mask, x + i), zero));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline __m512 exp_avx512(__m512 x) {
+    x = _mm512_maskz_min_ps(0xFFFF, _mm512_maskz_max_ps(0xFFFF, x, _mm512_set1_ps(-87.0f)), _mm512_set1_ps(88.0f));
+    auto t = _mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504f), _mm512_set1_ps(0.5f));
+    auto n = _mm512_maskz_roundscale_ps(0xFFFF, t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    auto r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fmadd_ps(n, _mm512_set1_ps(2.12194440e-4f), r);
+    auto p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    auto e = _mm512_add_ps(_mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r), _mm512_set1_ps(1.0f));
+    return _mm512_maskz_scalef_ps(0xFFFF, e, n);
+}
+
+// Full vectors and the tail share one body, as in update_avx512.
+__attribute__((target("avx512f")))
+void sigmoid_avx512(float* x, std::size_t n) {
+    auto one = _mm512_set1_ps(1.0f);
+    for (std::size_t i = 0; i < n; i += 16) {
+        auto mask = n - i >= 16 ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - i)) - 1);
+        auto e = exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), _mm512_maskz_loadu_ps(mask, x + i)));
+        _mm512_mask_storeu_ps(x + i, mask, _mm512_div_ps(one, _mm512_add_ps(one, e)));
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 widen_bf16_avx2(__m128i x) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(x), 16));
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 widen_fp16_avx2(__m128i x) {
+    return _mm256_cvtph_ps(x);
+}
+
+// Gathered 32-bit words start at the wanted element, whose bits are the low half.
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 gather_bf16_avx2(std::uint16_t const* x, __m256i indices) {
+    auto words = _mm256_i32gather_epi32(reinterpret_cast<int const*>(x), indices, 2);
+    return _mm256_castsi256_ps(_mm256_slli_epi32(words, 16));
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 gather_fp16_avx2(std::uint16_t const* x, __m256i indices) {
+    auto words = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<int const*>(x), indices, 2), _mm256_set1_epi32(0xFFFF));
+    auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(words, words), 0x08);
+    return _mm256_cvtph_ps(_mm256_castsi256_si128(packed));
+}
+
+template<__m256 (*Widen)(__m128i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx2,fma,f16c")))
+float dot_half_avx2(float const* x, std::uint16_t const* y, std::size_t n) {
+    auto acc0 = _mm256_setzero_ps();
+    auto acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto y0 = Widen(_mm_loadu_si128(reinterpret_cast<__m128i const*>(y + i)));
+        auto y1 = Widen(_mm_loadu_si128(reinterpret_cast<__m128i const*>(y + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), y0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), y1, acc1);
+    }
+    auto acc = _mm256_add_ps(acc0, acc1);
+    float sum = hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i < n; i++) {
+        sum += x[i] * Scalar(y[i]);
+    }
+    return sum;
+}
+
+template<__m256 (*Gather)(std::uint16_t const*, __m256i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx2,fma,f16c")))
+float gather_sum_half_avx2(std::uint16_t const* x, std::uint32_t const* indices, std::size_t n) {
+    auto acc0 = _mm256_setzero_ps();
+    auto acc1 = _mm256_setzero_ps();
+    std::size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        acc0 = _mm256_add_ps(acc0, Gather(x, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + k))));
+        acc1 = _mm256_add_ps(acc1, Gather(x, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + k + 8))));
+    }
+    auto acc = _mm256_add_ps(acc0, acc1);
+    float sum = hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; k < n; k++) {
+        sum += Scalar(x[indices[k]]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline __m256i narrow_bf16_avx2(__m256 x) {
+    auto bits = _mm256_castps_si256(x);
+    auto lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    auto rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF))), 16);
+    auto magnitude = _mm256_and_si256(bits, _mm256_set1_epi32(0x7FFFFFFF));
+    auto nan = _mm256_cmpgt_epi32(magnitude, _mm256_set1_epi32(0x7F800000));
+    auto quiet = _mm256_or_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(0x40));
+    return _mm256_blendv_epi8(rounded, quiet, nan);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+void to_bf16_avx2(float const* x, std::uint16_t* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto lo = narrow_bf16_avx2(_mm256_loadu_ps(x + i));
+        auto hi = narrow_bf16_avx2(_mm256_loadu_ps(x + i + 8));
+        auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), packed);
+    }
+    for (; i < n; i++) {
+        y[i] = float_to_bf16(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+void to_fp16_avx2(float const* x, std::uint16_t* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto packed = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), packed);
+    }
+    for (; i < n; i++) {
+        y[i] = float_to_fp16(x[i]);
+    }
+}
+
+template<__m256 (*Widen)(__m128i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx2,fma,f16c")))
+void from_half_avx2(std::uint16_t const* x, float* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, Widen(_mm_loadu_si128(reinterpret_cast<__m128i const*>(x + i))));
+    }
+    for (; i < n; i++) {
+        y[i] = Scalar(x[i]);
+    }
+}
+
+constexpr HalfKernels BF16_AVX2 = {
+    dot_half_avx2<widen_bf16_avx2, bf16_to_float>,
+    gather_sum_half_avx2<gather_bf16_avx2, bf16_to_float>,
+    to_bf16_avx2,
+    from_half_avx2<widen_bf16_avx2, bf16_to_float>,
+};
+
+constexpr HalfKernels FP16_AVX2 = {
+    dot_half_avx2<widen_fp16_avx2, fp16_to_float>,
+    gather_sum_half_avx2<gather_fp16_avx2, fp16_to_float>,
+    to_fp16_avx2,
+    from_half_avx2<widen_fp16_avx2, fp16_to_float>,
+};
+
+__attribute__((target("avx512f")))
+inline __m512 widen_bf16_avx512(__m256i x) {
+    return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, _mm512_maskz_cvtepu16_epi32(0xFFFF, x), 16));
+}
+
+__attribute__((target("avx512f")))
+inline __m512 gather_bf16_avx512(std::uint16_t const* x, __m512i indices) {
+    auto words = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, indices, x, 2);
+    return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, words, 16));
+}
+
+// Widens fp16 bits held in the low half of 32-bit lanes without narrowing
+// them first. Normal numbers (and inf/NaN) only need their exponent rebased;
+// subnormals are converted from their integer mantissa so that no fp32
+// operation ever sees a denormal operand.
+__attribute__((target("avx512f")))
+inline __m512 widen_fp16_lanes_avx512(__m512i words) {
+    auto magnitude = _mm512_and_si512(words, _mm512_set1_epi32(0x7FFF));
+    auto sign = _mm512_maskz_slli_epi32(0xFFFF, _mm512_and_si512(words, _mm512_set1_epi32(0x8000)), 16);
+    auto rebias = _mm512_set1_epi32((127 - 15) << 23);
+    auto bits = _mm512_add_epi32(_mm512_maskz_slli_epi32(0xFFFF, magnitude, 13), rebias);
+    auto special = _mm512_cmpge_epu32_mask(magnitude, _mm512_set1_epi32(0x7C00));
+    bits = _mm512_mask_add_epi32(bits, special, bits, rebias);
+    auto subnormal = _mm512_cmplt_epu32_mask(magnitude, _mm512_set1_epi32(0x0400));
+    auto small = _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(0xFFFF, magnitude), _mm512_set1_ps(1.0f / (1 << 24)));
+    bits = _mm512_mask_mov_epi32(bits, subnormal, _mm512_castps_si512(small));
+    return _mm512_castsi512_ps(_mm512_or_si512(bits, sign));
+}
+
+__attribute__((target("avx512f")))
+inline __m512 widen_fp16_avx512(__m256i x) {
+    return _mm512_maskz_cvtph_ps(0xFFFF, x);
+}
+
+template<__m512 (*Widen)(__m256i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx512f")))
+float dot_half_avx512(float const* x, std::uint16_t const* y, std::size_t n) {
+    auto acc0 = _mm512_setzero_ps();
+    auto acc1 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto y0 = Widen(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i)));
+        auto y1 = Widen(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i + 16)));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), y0, acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), y1, acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        auto y0 = Widen(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(y + i)));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), y0, acc0);
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+    float sum = 0.0f;
+    for (float lane: lanes) {
+        sum += lane;
+    }
+    for (; i < n; i++) {
+        sum += x[i] * Scalar(y[i]);
+    }
+    return sum;
+}
+
+template<__m512 (*Gather)(std::uint16_t const*, __m512i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx512f")))
+float gather_sum_half_avx512(std::uint16_t const* x, std::uint32_t const* indices, std::size_t n) {
+    auto acc0 = _mm512_setzero_ps();
+    auto acc1 = _mm512_setzero_ps();
+    std::size_t k = 0;
+    for (; k + 32 <= n; k += 32) {
+        acc0 = _mm512_add_ps(acc0, Gather(x, _mm512_loadu_si512(indices + k)));
+        acc1 = _mm512_add_ps(acc1, Gather(x, _mm512_loadu_si512(indices + k + 16)));
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+    float sum = 0.0f;
+    for (float lane: lanes) {
+        sum += lane;
+    }
+    for (; k < n; k++) {
+        sum += Scalar(x[indices[k]]);
+    }
+    return sum;
+}
+
+// A gather merges into its destination register, and GCC freely reuses the
+// register that held the previous conversion result, which would chain every
+// gather behind the long fp16 conversion. Raw words are staged in blocks so
+// the gathers only depend on each other.
+__attribute__((target("avx512f")))
+float gather_sum_fp16_avx512(std::uint16_t const* x, std::uint32_t const* indices, std::size_t n) {
+    static constexpr std::size_t BLOCK = 256;
+    alignas(64) std::uint32_t words[BLOCK];
+    auto acc = _mm512_setzero_ps();
+    std::size_t k = 0;
+    while (k + 16 <= n) {
+        auto count = std::min(BLOCK, (n - k) / 16 * 16);
+        for (std::size_t i = 0; i < count; i += 16) {
+            auto idx = _mm512_loadu_si512(indices + k + i);
+            _mm512_store_si512(words + i, _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, idx, x, 2));
+        }
+        for (std::size_t i = 0; i < count; i += 16) {
+            acc = _mm512_add_ps(acc, widen_fp16_lanes_avx512(_mm512_load_si512(words + i)));
+        }
+        k += count;
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, acc);
+    float sum = 0.0f;
+    for (float lane: lanes) {
+        sum += lane;
+    }
+    for (; k < n; k++) {
+        sum += fp16_to_float(x[indices[k]]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+void to_bf16_avx512(float const* x, std::uint16_t* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto bits = _mm512_castps_si512(_mm512_loadu_ps(x + i));
+        auto lsb = _mm512_and_si512(_mm512_maskz_srli_epi32(0xFFFF, bits, 16), _mm512_set1_epi32(1));
+        auto rounded = _mm512_maskz_srli_epi32(0xFFFF, _mm512_add_epi32(bits, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7FFF))), 16);
+        auto magnitude = _mm512_and_si512(bits, _mm512_set1_epi32(0x7FFFFFFF));
+        auto nan = _mm512_cmpgt_epu32_mask(magnitude, _mm512_set1_epi32(0x7F800000));
+        auto quiet = _mm512_or_si512(_mm512_maskz_srli_epi32(0xFFFF, bits, 16), _mm512_set1_epi32(0x40));
+        auto result = _mm512_mask_mov_epi32(rounded, nan, quiet);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), _mm512_maskz_cvtepi32_epi16(0xFFFF, result));
+    }
+    for (; i < n; i++) {
+        y[i] = float_to_bf16(x[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+void to_fp16_avx512(float const* x, std::uint16_t* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto packed = _mm512_maskz_cvtps_ph(0xFFFF, _mm512_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), packed);
+    }
+    for (; i < n; i++) {
+        y[i] = float_to_fp16(x[i]);
+    }
+}
+
+template<__m512 (*Widen)(__m256i), float (*Scalar)(std::uint16_t)>
+__attribute__((target("avx512f")))
+void from_half_avx512(std::uint16_t const* x, float* y, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, Widen(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i))));
+    }
+    for (; i < n; i++) {
+        y[i] = Scalar(x[i]);
+    }
+}
+
+constexpr HalfKernels BF16_AVX512 = {
+    dot_half_avx512<widen_bf16_avx512, bf16_to_float>,
+    gather_sum_half_avx512<gather_bf16_avx512, bf16_to_float>,
+    to_bf16_avx512,
+    from_half_avx512<widen_bf16_avx512, bf16_to_float>,
+};
+
+constexpr HalfKernels FP16_AVX512 = {
+    dot_half_avx512<widen_fp16_avx512, fp16_to_float>,
+    gather_sum_fp16_avx512,
+    to_fp16_avx512,
+    from_half_avx512<widen_fp16_avx512, fp16_to_float>,
+};
+
+#endif
+
+KernelTable select_kernels() {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+            return {
+                Isa::AVX512, dot_avx512, axpy_avx512, update_avx512, gather_sum_avx512, sum_rows_avx512, relu_avx512, sigmoid_avx512,
+                dot_u8s8_vnni, axpy_s8_avx512, "avx512-vnni", BF16_AVX512, FP16_AVX512,
+            };
+        }
+        return {
+            Isa::AVX512, dot_avx512, axpy_avx512, update_avx512, gather_sum_avx512, sum_rows_avx512, relu_avx512, sigmoid_avx512,
+            dot_u8s8_avx2, axpy_s8_avx512, "avx2", BF16_AVX512, FP16_AVX512,
+        };
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        bool f16c = __builtin_cpu_supports("f16c");
+        return {
+            Isa::AVX2, dot_avx2, axpy_avx2, update_avx2, gather_sum_avx2, sum_rows_avx2, relu_avx2, sigmoid_avx2,
+            dot_u8s8_avx2, axpy_s8_avx2, "avx2",
+            f16c ? BF16_AVX2 : BF16_SCALAR, f16c ? FP16_AVX2 : FP16_SCALAR,
+        };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        // SSE2 has no gather instruction, so gather_sum stays scalar on this tier.
+        return {
+            Isa::SSE2, dot_sse2, axpy_sse2, update_sse2, gather_sum_scalar, sum_rows_sse2, relu_sse2, sigmoid_sse2,
+            dot_u8s8_scalar, axpy_s8_scalar, "scalar", BF16_SCALAR, FP16_SCALAR,
+        };
+    }
+#endif
+    return {
+        Isa::Scalar, dot_scalar, axpy_scalar, update_scalar, gather_sum_scalar, sum_rows_scalar, relu_scalar, sigmoid_scalar,
+        dot_u8s8_scalar, axpy_s8_scalar, "scalar", BF16_SCALAR, FP16_SCALAR,
+    };
+}
+
+KernelTable const& table() {
+    static KernelTable const selected = select_kernels();
+    return selected;
+}
+
+}
+
+Isa active_isa() {
+    return table().isa;
+}
+
+char const* isa_name(Isa isa) {
+    switch (isa) {
+        case Isa::Scalar: return "scalar";
+        case Isa::SSE2: return "sse2";
+        case Isa::AVX2: return "avx2";
+        case Isa::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+char const* int8_kernel_name() {
+    return table().int8_name;
+}
+
+float dot(float const* x, float const* y, std::size_t n) {
+    return table().dot(x, y, n);
+}
+
+std::int32_t dot_u8s8(std::uint8_t const* x, std::int8_t const* y, std::size_t n) {
+    return table().dot_u8s8(x, y, n);
+}
+
+void axpy(float alpha, float const* x, float* y, std::size_t n) {
+    table().axpy(alpha, x, y, n);
+}
+
+void update(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n) {
+    table().update(params, w, m, v, g, n);
+}
+
+void rank1_update(float alpha, float const* x, std::size_t m, float const* y, std::size_t n, float* a, std::size_t lda) {
+    auto axpy_kernel = table().axpy;
+    for (std::size_t i = 0; i < m; i++) {
+        if (x[i] == 0.0f) continue;
+        axpy_kernel(alpha * x[i], y, a + i * lda, n);
+    }
+}
+
+void axpy_s8(std::int32_t alpha, std::int8_t const* x, std::int32_t* y, std::size_t n) {
+    table().axpy_s8(alpha, x, y, n);
+}
+
+float gather_sum(float const* x, std::uint32_t const* indices, std::size_t n) {
+    return table().gather_sum(x, indices, n);
+}
+
+void sum_rows(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n) {
+    table().sum_rows(x, stride, indices, count, y, n);
+}
+
+void relu(float* x, std::size_t n) {
+    table().relu(x, n);
+}
+
+void sigmoid(float* x, std::size_t n) {
+    table().sigmoid(x, n);
+}
+
+static HalfKernels const& half_kernels(WeightFormat format) {
+    return format == WeightFormat::Float16 ? table().fp16 : table().bf16;
+}
+
+float dot_half(WeightFormat format, float const* x, std::uint16_t const* y, std::size_t n) {
+    return half_kernels(format).dot(x, y, n);
+}
+
+float gather_sum_half(WeightFormat format, std::uint16_t const* x, std::uint32_t const* indices, std::size_t n) {
+    return half_kernels(format).gather_sum(x, indices, n);
+}
+
+void to_half(WeightFormat format, float const* x, std::uint16_t* y, std::size_t n) {
+    half_kernels(format).to_half(x, y, n);
+}
+
+void from_half(WeightFormat format, std::uint16_t const* x, float* y, std::size_t n) {
+    half_kernels(format).from_half(x, y, n);
+}
+
+std::uint16_t to_half(WeightFormat format, float x) {
+    return format == WeightFormat::Float16 ? float_to_fp16(x) : float_to_bf16(x);
+}
+
+}
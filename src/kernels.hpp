@@ -0,0 +1,123 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Vectorized building blocks for the dense layers. Kernels come in scalar,
+// SSE2, AVX2 and AVX-512 variants (gathers and half formats have no SSE2
+// form, half formats on AVX2 also need F16C); the widest set
+// the CPU supports is picked once, on first use, from the cpuid feature bits.
+namespace kernels {
+
+// Storage format of layer weights. Half formats are widened to fp32 as they
+// are loaded, so all arithmetic stays fp32.
+enum class WeightFormat : std::uint32_t {
+    Float32 = 0,
+    BFloat16 = 1,
+    Float16 = 2,
+};
+
+// Parameter update rules of the optimizers, with their state:
+//   Sgd        w -= rate * g
+//   Momentum   m = beta1 * m + g; w -= rate * m
+//   Nesterov   m = beta1 * m + g; w -= rate * (g + beta1 * m)
+//   Adam       m = beta1 * m + (1 - beta1) * g; v = beta2 * v + (1 - beta2) * g^2;
+//              w -= rate * m / (sqrt(v) + epsilon)
+// Adam's bias correction is expected to be folded into `rate`.
+enum class UpdateRule : std::uint32_t {
+    Sgd = 0,
+    Momentum = 1,
+    Nesterov = 2,
+    Adam = 3,
+};
+
+struct UpdateParams {
+    UpdateRule rule;
+    float rate;
+    float beta1;
+    float beta2;
+    float epsilon;
+};
+
+inline void momentum_step(UpdateParams const& params, float& w, float& m, float g) {
+    m = params.beta1 * m + g;
+    w -= params.rate * m;
+}
+
+inline void nesterov_step(UpdateParams const& params, float& w, float& m, float g) {
+    m = params.beta1 * m + g;
+    w -= params.rate * (g + params.beta1 * m);
+}
+
+inline void adam_step(UpdateParams const& params, float& w, float& m, float& v, float g) {
+    m = params.beta1 * m + (1.0f - params.beta1) * g;
+    v = params.beta2 * v + (1.0f - params.beta2) * g * g;
+    w -= params.rate * m / (std::sqrt(v) + params.epsilon);
+}
+
+// exp(x) with x clamped to [-87, 88]: Cody-Waite reduction to
+// r in [-ln2/2, ln2/2] and the cephes degree-5 polynomial for exp(r).
+// Relative error stays below 1e-7 over the whole clamped range.
+inline float fast_exp(float x) {
+    x = x < -87.0f ? -87.0f : x > 88.0f ? 88.0f : x;
+    auto n = std::floor(x * 1.44269504f + 0.5f);
+    auto r = x - n * 0.693359375f + n * 2.12194440e-4f;
+    auto p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    return std::ldexp(p * r * r + r + 1.0f, static_cast<int>(n));
+}
+
+// 1 / (1 + fast_exp(-x)), within 1e-7 (absolute) of the exact sigmoid for
+// every input; relative error grows only where the result is below 1e-37.
+inline float fast_sigmoid(float x) {
+    return 1.0f / (1.0f + fast_exp(-x));
+}
+
+enum class Isa {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512,
+};
+
+Isa active_isa();
+char const* isa_name(Isa isa);
+// The int8 dot product has its own variants: AVX-512 VNNI, AVX2 or scalar.
+char const* int8_kernel_name();
+
+// sum(x[i] * y[i])
+float dot(float const* x, float const* y, std::size_t n);
+// y += alpha * x
+void axpy(float alpha, float const* x, float* y, std::size_t n);
+// One fused pass of `params.rule` over n weights, their state and gradient.
+// m is unused by Sgd and v by everything but Adam; they may then be null.
+void update(UpdateParams const& params, float* w, float* m, float* v, float const* g, std::size_t n);
+// A += alpha * x * y^T, with A: m x n and row stride lda
+void rank1_update(float alpha, float const* x, std::size_t m, float const* y, std::size_t n, float* a, std::size_t lda);
+// sum(x[indices[k]])
+float gather_sum(float const* x, std::uint32_t const* indices, std::size_t n);
+// y[i] += sum(x[indices[k] * stride + i]) for i < n: adds up the rows of a
+// matrix (row stride `stride`) picked by `indices`
+void sum_rows(float const* x, std::size_t stride, std::uint32_t const* indices, std::size_t count, float* y, std::size_t n);
+// sum(x[i] * y[i]) with x in [0, 127]; larger x may saturate the AVX2 kernel
+std::int32_t dot_u8s8(std::uint8_t const* x, std::int8_t const* y, std::size_t n);
+// y += alpha * x, widening int8 to int32
+void axpy_s8(std::int32_t alpha, std::int8_t const* x, std::int32_t* y, std::size_t n);
+// sum(x[i] * y[i]) with y in a half format
+float dot_half(WeightFormat format, float const* x, std::uint16_t const* y, std::size_t n);
+// sum(x[indices[k]]) with x in a half format; x must be readable 2 bytes past its last element
+float gather_sum_half(WeightFormat format, std::uint16_t const* x, std::uint32_t const* indices, std::size_t n);
+// Round-to-nearest-even conversions between fp32 and a half format
+void to_half(WeightFormat format, float const* x, std::uint16_t* y, std::size_t n);
+void from_half(WeightFormat format, std::uint16_t const* x, float* y, std::size_t n);
+std::uint16_t to_half(WeightFormat format, float x);
+// x = max(x, 0)
+void relu(float* x, std::size_t n);
+// x = fast_sigmoid(x)
+void sigmoid(float* x, std::size_t n);
+
+}
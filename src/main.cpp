@@ -1,77 +1,351 @@
 #include "dataLoader.hpp"
+#include "batchStream.hpp"
 #include "nn.hpp"
 #include "utils.hpp"
+#include "kernels.hpp"
+#include "threadPool.hpp"
+#include "quantized.hpp"
+#include "staticNet.hpp"
 #include <iostream>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
 
 GlobalConfig global_config {
     200,
     200,
     {"bee", "carrot", "key"},
     1.0f,
+    16,
+    0,
+    false,
     RunMode::Learn,
-    "result"
+    "result",
+    "data",
+    false,
+    kernels::WeightFormat::Float32,
+    kernels::UpdateRule::Sgd,
+    0,
+    60.0,
+    false,
+    {},
+    false,
 };
 
-void learn_nn() {
-    auto loader = DataLoader("data");
-    std::cout << "Loading dataset...\n";
-    loader.load(global_config.image_count_per_category, global_config.categories);
-    auto data = loader.get_data();
-    auto [training, test_datset] = split_dataset(data, 0.7f);
-    training = DataLoader::shuffle_data(training);
+// Share of every category that is trained on; the rest is the test set.
+constexpr float TRAIN_FRACTION = 0.7f;
 
-    std::cout << "Loaded " <<  data.size() << " images\n";
-    auto categories = loader.get_names(); 
+// Shrinks the image 32 times per side: a 256 pixel drawing reaches the dense
+// layers as 16 maps of 8x8, from about 1.4k convolution weights.
+std::vector<NeuralNet::Feature> convolution_features() {
+    return {
+        {LayerKind::Conv2D, 8, 5, 2, 2},
+        {LayerKind::MaxPool2D, 0, 4, 4},
+        {LayerKind::Conv2D, 16, 3, 1, 1},
+        {LayerKind::MaxPool2D, 0, 4, 4},
+    };
+}
 
-    auto config = NeuralNet::Config {
+NeuralNet::Config make_config(std::set<std::string> const& categories, std::size_t input_size) {
+    return NeuralNet::Config {
         categories,
         {
-            {256 * 256, 256},
+            {input_size, 256},
             {256, 128},
             {128, 5},
         },
-        {ReLu, ReLu, sigm},
-        {ReLu_derivative, ReLu_derivative, sigm_derivative},
+        {ReLu, ReLu, global_config.fast_sigmoid ? fast_sigm : sigm},
+        {ReLu_derivative, ReLu_derivative, global_config.fast_sigmoid ? fast_sigm_derivative : sigm_derivative},
         MSE,
+        global_config.weight_format,
+        global_config.convolutional ? convolution_features() : std::vector<NeuralNet::Feature>{},
     };
+}
 
-    std::cout << "Creating network\n";
-    auto net = NeuralNet(config);
-    float start_loss = net.calculate_total_cost(test_datset);
+// make_config's three dense layers over unprocessed 256x256 images, with
+// activations and shapes fixed at compile time. Any other model, such as one
+// trained on cropped or pooled images, is not specialized.
+template<typename Output>
+using ClassifierNet = StaticNet<
+    StaticLayer<ReLuActivation, 256 * 256, 256>,
+    StaticLayer<ReLuActivation, 256, 128>,
+    StaticLayer<Output, 128, 5>
+>;
+
+// Calls `use` with the ClassifierNet matching `net`'s output activation, if any.
+template<typename Use>
+void with_classifier_net(NeuralNet const& net, Use const& use) {
+    if (ClassifierNet<SigmoidActivation>::matches(net)) {
+        use(std::make_shared<ClassifierNet<SigmoidActivation>>(net));
+    } else if (ClassifierNet<FastSigmoidActivation>::matches(net)) {
+        use(std::make_shared<ClassifierNet<FastSigmoidActivation>>(net));
+    }
+}
+
+// The network takes the images as they come out of the preprocessing.
+std::size_t input_size(Dataset const& data) {
+    if (data.empty()) {
+        std::cerr << "No images loaded\n";
+        exit(1);
+    }
+    return data[0].image.size();
+}
+
+NeuralNet::TrainConfig make_train_config() {
+    return NeuralNet::TrainConfig {
+        global_config.L_learn_iterations,
+        global_config.learn_rate,
+        global_config.batch_size,
+        global_config.threads,
+        {global_config.optimizer},
+        global_config.result_dirname + "/checkpoint.bin",
+        global_config.checkpoint_interval,
+        global_config.checkpoint_seconds,
+        true,
+    };
+}
+
+char const* weight_format_name(kernels::WeightFormat format) {
+    switch (format) {
+        case kernels::WeightFormat::BFloat16: return "bf16";
+        case kernels::WeightFormat::Float16: return "fp16";
+        default: return "fp32";
+    }
+}
+
+// Quantizes the trained model and compares it with the float one on the test split.
+void report_quantization(NeuralNet const& net, DatasetView const& test_datset, ThreadPool& pool) {
+    if (test_datset.empty()) return;
+
+    auto accuracy = [&](NeuralNet::Predictions const& predictions) {
+        std::size_t correct = 0;
+        for (std::size_t b = 0; b < test_datset.size(); b++) {
+            correct += predictions.classes[b] == net.get_result_index(test_datset[b].name);
+        }
+        return 100.0 * correct / test_datset.size();
+    };
+    auto timed = [&](auto const& model) {
+        auto start = std::chrono::steady_clock::now();
+        auto predictions = model.predict(test_datset, pool);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_pair(std::move(predictions), test_datset.size() / elapsed.count());
+    };
+
+    auto [floating, float_rate] = timed(net);
+    auto agreement = [&](NeuralNet::Predictions const& predictions) {
+        std::size_t agree = 0;
+        for (std::size_t b = 0; b < test_datset.size(); b++) {
+            agree += floating.classes[b] == predictions.classes[b];
+        }
+        return 100.0 * agree / test_datset.size();
+    };
+    std::size_t float_size = 0;
+    for (auto const& layer: net.get_layers()) {
+        float_size += layer.memory_size();
+    }
+
+    std::cout << std::fixed << std::setprecision(1)
+        << "float model (" << weight_format_name(net.get_layers().back().get_weight_format()) << " weights): accuracy "
+        << accuracy(floating) << "%, " << float_rate << " img/s, " << float_size / 1e6 << " MB\n";
+
+    if (QuantizedNet::supports(net)) {
+        auto quantized = QuantizedNet(net);
+        auto [int8, int8_rate] = timed(quantized);
+        std::cout << "int8 model (" << kernels::int8_kernel_name() << "): accuracy " << accuracy(int8) << "%, "
+            << int8_rate << " img/s, " << quantized.memory_size() / 1e6 << " MB, agrees with float on "
+            << agreement(int8) << "%\n";
+    }
+
+    with_classifier_net(net, [&](auto const& model) {
+        auto [specialized, specialized_rate] = timed(*model);
+        std::cout << "specialized model: accuracy " << accuracy(specialized) << "%, " << specialized_rate
+            << " img/s, agrees with float on " << agreement(specialized) << "%\n";
+    });
+}
+
+void train_and_report(NeuralNet& net, DatasetView const& test_datset, std::function<void()> const& learn) {
+    auto pool = ThreadPool(global_config.threads);
+    float start_loss = net.calculate_total_cost(test_datset, pool);
 
     std::cout << "Learning...\n";
-    net.learn(training, global_config.L_learn_iterations, global_config.learn_rate);
-    std::cout << "\nFinished learning\n";
-    float end_loss = net.calculate_total_cost(test_datset);
+    learn();
+    std::cout << "\nFinished learning\n" << net.get_training_stats().summary();
+    float end_loss = net.calculate_total_cost(test_datset, pool);
 
     std::cout 
         << "Cost before learning: " << start_loss 
         << "\nCost after learning: " << end_loss 
         << std::endl;
 
-    net.dump_statistics(global_config.result_dirname, test_datset);
+    report_quantization(net, test_datset, pool);
+    net.dump_statistics(global_config.result_dirname, test_datset, pool);
+}
+
+// Views share the loader's records. Records come grouped by category, so
+// the split is per category: a plain one would test on the last alone.
+std::pair<DatasetView, DatasetView> train_test_split(Dataset const& data) {
+    return DatasetView(data).stratified_split(TRAIN_FRACTION);
+}
+
+void learn_nn() {
+    auto loader = DataLoader("data");
+    loader.set_preprocessing(global_config.preprocessing);
+    std::cout << "Loading dataset...\n";
+    loader.load(global_config.image_count_per_category, global_config.categories, global_config.threads);
+    auto const& data = loader.get_data();
+    auto [training, test_datset] = train_test_split(data);
+
+    std::cout << "Loaded " <<  data.size() << " images\n";
+    auto categories = loader.get_names(); 
+
+    std::cout << "Creating network\n";
+    auto net = NeuralNet(make_config(categories, input_size(data)));
+    train_and_report(net, test_datset, [&]{ net.learn(training, make_train_config()); });
+}
+
+// Same 70/30 split per category as learn_nn, but training images are decoded
+// in the background while the network trains and never held all at once.
+void stream_nn() {
+    auto loader = DataLoader("data");
+    auto per_category = global_config.image_count_per_category;
+    auto train_count = static_cast<std::size_t>(per_category * TRAIN_FRACTION);
+
+    auto train_stream = StreamConfig{};
+    train_stream.names = global_config.categories;
+    train_stream.record_count = train_count;
+    train_stream.batch_size = global_config.batch_size;
+    train_stream.preprocessing = global_config.preprocessing;
+    auto stream = BatchStream(loader.get_filepaths(), train_stream);
+
+    auto test_stream = StreamConfig{};
+    test_stream.names = global_config.categories;
+    test_stream.first_record = train_count;
+    test_stream.record_count = per_category - train_count;
+    test_stream.batch_size = 256;
+    test_stream.shuffle_window = 0;
+    test_stream.repeat = false;
+    test_stream.preprocessing = global_config.preprocessing;
+    std::cout << "Loading test images...\n";
+    auto test_datset = BatchStream(loader.get_filepaths(), test_stream).collect();
+    std::cout << "Loaded " << test_datset.size() << " test images\n";
+
+    std::cout << "Creating network\n";
+    auto categories = std::set<std::string>(global_config.categories.begin(), global_config.categories.end());
+    auto net = NeuralNet(make_config(categories, input_size(test_datset)));
+    train_and_report(net, test_datset, [&]{ net.learn(stream, make_train_config()); });
 }
 
 void load_nn() {
-    auto nn_config = FileConfig::from_file("result/weights.txt");
-    auto nn = NeuralNet(nn_config);
+    auto load_start = std::chrono::steady_clock::now();
+    auto nn = NeuralNet(FileConfig::from_file("result/weights.bin"));
+    auto load_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start);
+    std::cout << "Loaded model in " << load_time.count() << " ms\n";
 
     auto loader = DataLoader("data");
-    loader.load(global_config.image_count_per_category, global_config.categories);
+    loader.set_preprocessing(global_config.preprocessing);
+    loader.load(global_config.image_count_per_category, global_config.categories, global_config.threads);
     auto const& data = loader.get_data();
-    auto [training, test_datset] = split_dataset(data, 0.7f);
-    training = DataLoader::shuffle_data(training);
+    auto [training, test_datset] = train_test_split(data);
     std::cout << "Loaded " <<  data.size() << " images\n";
 }
 
+// Classifies every image in predict_dirname with the trained model. Files are
+// streamed in chunks, so the directory does not have to fit in memory.
+void predict_nn() {
+    static constexpr std::size_t CHUNK_SIZE = 4096;
+    auto nn = NeuralNet(FileConfig::from_file(global_config.result_dirname + "/weights.bin"));
+    auto pool = ThreadPool(global_config.threads);
+    std::string model_name = weight_format_name(nn.get_layers().back().get_weight_format());
+    std::function<NeuralNet::Predictions(Dataset const&)> predict = [&](Dataset const& chunk) {
+        return nn.predict(chunk, pool);
+    };
+    // Convolutional models have no int8 version and keep their float one.
+    if (global_config.int8_inference && QuantizedNet::supports(nn)) {
+        auto quantized = std::make_shared<QuantizedNet>(nn);
+        model_name = "int8";
+        predict = [quantized, &pool](Dataset const& chunk) { return quantized->predict(chunk, pool); };
+    } else {
+        with_classifier_net(nn, [&](auto const& specialized) {
+            model_name = "specialized " + model_name;
+            predict = [specialized, &pool](Dataset const& chunk) { return specialized->predict(chunk, pool); };
+        });
+    }
+    auto loader = DataLoader(global_config.predict_dirname);
+
+    auto stream_config = StreamConfig{};
+    stream_config.batch_size = CHUNK_SIZE;
+    stream_config.shuffle_window = 0;
+    stream_config.repeat = false;
+    stream_config.preprocessing = global_config.preprocessing;
+    auto stream = BatchStream(loader.get_filepaths(), stream_config);
+
+    auto output_path = global_config.result_dirname + "/classified.txt";
+    auto output = std::ofstream(output_path, std::ios::out | std::ios::trunc);
+    if (!output.is_open()) {
+        std::cerr << "Unable to write " << output_path << '\n';
+        exit(1);
+    }
+
+    std::size_t total = 0, labelled = 0, correct = 0;
+    std::chrono::duration<double> inference_time{0};
+    auto start = std::chrono::steady_clock::now();
+    Dataset chunk;
+    std::string lines;
+    while (stream.next(chunk)) {
+        if (chunk[0].image.size() != nn.get_layers()[0].get_in_size()) {
+            std::cerr << "Images have " << chunk[0].image.size() << " pixels after preprocessing, the model takes "
+                << nn.get_layers()[0].get_in_size() << '\n';
+            exit(1);
+        }
+        auto inference_start = std::chrono::steady_clock::now();
+        auto predictions = predict(chunk);
+        inference_time += std::chrono::steady_clock::now() - inference_start;
+
+        for (std::size_t b = 0; b < chunk.size(); b++) {
+            auto index = predictions.classes[b];
+            auto predicted = nn.get_result_name(index);
+            lines += chunk[b].name + ' ' + predicted + ' ' + std::to_string(predictions.scores(b, index)) + '\n';
+            if (nn.has_class(chunk[b].name)) {
+                labelled++;
+                correct += chunk[b].name == predicted;
+            }
+        }
+        output << lines;
+        lines.clear();
+        total += chunk.size();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "Classified " << total << " images (" << model_name << ") in " << elapsed.count() << " s";
+    if (total > 0) {
+        std::cout << " (" << total / elapsed.count() << " img/s overall, "
+            << total / inference_time.count() << " img/s inference)";
+    }
+    std::cout << '\n';
+    if (labelled > 0) {
+        std::cout << "Accuracy on labelled images: " << 100.0 * correct / labelled << "%\n";
+    }
+    std::cout << "Predictions written to " << output_path << '\n';
+}
+
 int main() { 
+    std::cout << "Using " << kernels::isa_name(kernels::active_isa()) << " kernels\n";
     switch (global_config.mode) {
         case RunMode::Learn:
-            learn_nn();
+            if (global_config.stream_dataset) {
+                stream_nn();
+            } else {
+                learn_nn();
+            }
             break;
         case RunMode::Load:
             load_nn();
             break;
+        case RunMode::Predict:
+            predict_nn();
+            break;
     }
 
     return 0;
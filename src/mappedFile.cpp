@@ -0,0 +1,37 @@
+#include "mappedFile.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<MappedFile> MappedFile::open(std::string const& path, Mode mode) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    auto size = static_cast<std::size_t>(info.st_size);
+    auto protection = mode == Mode::CopyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* data = mmap(nullptr, size, protection, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    return std::make_shared<MappedFile>(data, size);
+}
+
+MappedFile::MappedFile(void* data, std::size_t size): data_(data), size_(size) {
+}
+
+MappedFile::~MappedFile() {
+    munmap(data_, size_);
+}
+
+void MappedFile::advise_sequential() const {
+    madvise(data_, size_, MADV_SEQUENTIAL);
+}
+
+void MappedFile::advise_will_need() const {
+    madvise(data_, size_, MADV_WILLNEED);
+}
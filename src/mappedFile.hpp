@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Whole-file memory mapping. CopyOnWrite maps the file privately and writable,
+// so pages can be modified in memory without touching the file.
+class MappedFile {
+public:
+    enum class Mode {
+        ReadOnly,
+        CopyOnWrite,
+    };
+
+    // Returns nullptr when the file cannot be opened or mapped.
+    static std::shared_ptr<MappedFile> open(std::string const& path, Mode mode = Mode::ReadOnly);
+
+    MappedFile(void* data, std::size_t size);
+    ~MappedFile();
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    char* data() { return static_cast<char*>(data_); }
+    char const* data() const { return static_cast<char const*>(data_); }
+    std::size_t size() const { return size_; }
+    void advise_sequential() const;
+    void advise_will_need() const;
+
+private:
+    void* data_;
+    std::size_t size_;
+};
@@ -0,0 +1,266 @@
+#include "matrix.hpp"
+#include "kernels.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+
+static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// Panel sizes keep a block of B (NT_BLOCK_N rows x NT_BLOCK_K floats) and the
+// active rows of C (BLOCK_N floats) resident in L2 while A streams through.
+static constexpr std::size_t NT_BLOCK_N = 64;
+static constexpr std::size_t NT_BLOCK_K = 1024;
+static constexpr std::size_t BLOCK_N = 4096;
+
+static std::size_t round_up(std::size_t value, std::size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+Matrix::Matrix(std::size_t rows, std::size_t cols, MemoryHint hint):
+    rows_(rows),
+    cols_(cols),
+    stride_(round_up(cols, ROW_ALIGNMENT)),
+    hint_(hint) {
+    allocate();
+}
+
+Matrix::Matrix(Matrix const& other):
+    rows_(other.rows_),
+    cols_(other.cols_),
+    stride_(other.stride_),
+    hint_(other.hint_) {
+    allocate();
+    std::copy(other.data_, other.data_ + storage_size(), data_);
+}
+
+Matrix::Matrix(Matrix&& other) noexcept {
+    *this = std::move(other);
+}
+
+Matrix Matrix::view(float* data, std::size_t rows, std::size_t cols, std::size_t stride, std::shared_ptr<void> owner) {
+    Matrix result;
+    result.rows_ = rows;
+    result.cols_ = cols;
+    result.stride_ = stride;
+    result.capacity_ = rows * stride;
+    result.storage_ = std::shared_ptr<float>(std::move(owner), data);
+    result.data_ = data;
+    return result;
+}
+
+Matrix& Matrix::operator=(Matrix const& other) {
+    if (this != &other) {
+        *this = Matrix(other);
+    }
+    return *this;
+}
+
+Matrix& Matrix::operator=(Matrix&& other) noexcept {
+    rows_ = std::exchange(other.rows_, 0);
+    cols_ = std::exchange(other.cols_, 0);
+    stride_ = std::exchange(other.stride_, 0);
+    capacity_ = std::exchange(other.capacity_, 0);
+    hint_ = other.hint_;
+    storage_ = std::move(other.storage_);
+    data_ = std::exchange(other.data_, nullptr);
+    return *this;
+}
+
+void Matrix::fill(float value) {
+    std::fill(data_, data_ + storage_size(), value);
+}
+
+void Matrix::resize(std::size_t rows, std::size_t cols) {
+    if (rows == rows_ && cols == cols_) return;
+    auto stride = round_up(cols, ROW_ALIGNMENT);
+    if (rows * stride <= capacity_) {
+        rows_ = rows;
+        cols_ = cols;
+        stride_ = stride;
+        return;
+    }
+    *this = Matrix(rows, cols, hint_);
+}
+
+void Matrix::allocate() {
+    capacity_ = storage_size();
+    auto bytes = capacity_ * sizeof(float);
+    if (bytes == 0) {
+        storage_.reset();
+        data_ = nullptr;
+        return;
+    }
+
+    if (hint_ == MemoryHint::HugePages && bytes >= HUGE_PAGE_SIZE) {
+        auto mapped_bytes = round_up(bytes, HUGE_PAGE_SIZE);
+        void* mem = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(mem, mapped_bytes, MADV_HUGEPAGE);
+#endif
+            storage_ = std::shared_ptr<float>(static_cast<float*>(mem), [mapped_bytes](float* ptr) {
+                munmap(ptr, mapped_bytes);
+            });
+            data_ = storage_.get();
+            return;
+        }
+    }
+
+    void* mem = std::aligned_alloc(ALIGNMENT, round_up(bytes, ALIGNMENT));
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memset(mem, 0, bytes);
+    storage_ = std::shared_ptr<float>(static_cast<float*>(mem), [](float* ptr) { std::free(ptr); });
+    data_ = storage_.get();
+}
+
+HalfMatrix::HalfMatrix(WeightFormat format, std::size_t rows, std::size_t cols):
+    format_(format),
+    rows_(rows),
+    cols_(cols),
+    stride_(round_up(cols, ROW_ALIGNMENT)) {
+    auto bytes = round_up(storage_size() * sizeof(std::uint16_t) + Matrix::ALIGNMENT, Matrix::ALIGNMENT);
+    void* mem = std::aligned_alloc(Matrix::ALIGNMENT, bytes);
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memset(mem, 0, bytes);
+    storage_ = std::shared_ptr<std::uint16_t>(static_cast<std::uint16_t*>(mem), [](std::uint16_t* ptr) { std::free(ptr); });
+    data_ = storage_.get();
+}
+
+HalfMatrix::HalfMatrix(HalfMatrix const& other): HalfMatrix(other.format_, other.rows_, other.cols_) {
+    std::copy(other.data_, other.data_ + storage_size(), data_);
+}
+
+HalfMatrix& HalfMatrix::operator=(HalfMatrix const& other) {
+    if (this != &other) {
+        *this = HalfMatrix(other);
+    }
+    return *this;
+}
+
+HalfMatrix HalfMatrix::view(
+    WeightFormat format,
+    std::uint16_t* data,
+    std::size_t rows,
+    std::size_t cols,
+    std::size_t stride,
+    std::shared_ptr<void> owner
+) {
+    HalfMatrix result;
+    result.format_ = format;
+    result.rows_ = rows;
+    result.cols_ = cols;
+    result.stride_ = stride;
+    result.storage_ = std::shared_ptr<std::uint16_t>(std::move(owner), data);
+    result.data_ = data;
+    return result;
+}
+
+HalfMatrix HalfMatrix::from_float(WeightFormat format, Matrix const& source) {
+    auto result = HalfMatrix(format, source.rows(), source.cols());
+    result.assign(source, 0, source.rows());
+    return result;
+}
+
+void HalfMatrix::assign(Matrix const& source, std::size_t first_row, std::size_t last_row) {
+    for (std::size_t j = first_row; j < last_row; j++) {
+        kernels::to_half(format_, source.row(j), row(j), cols_);
+    }
+}
+
+Matrix HalfMatrix::to_float() const {
+    auto result = Matrix(rows_, cols_, MemoryHint::HugePages);
+    for (std::size_t j = 0; j < rows_; j++) {
+        kernels::from_half(format_, row(j), result.row(j), cols_);
+    }
+    return result;
+}
+
+static void scale(float beta, float* y, std::size_t n) {
+    if (beta == 0.0f) {
+        std::fill(y, y + n, 0.0f);
+    } else if (beta != 1.0f) {
+        for (std::size_t i = 0; i < n; i++) {
+            y[i] *= beta;
+        }
+    }
+}
+
+void gemm_nt(Matrix const& a, Matrix const& b, Matrix& c, float alpha, float beta) {
+    auto m = a.rows(), n = b.rows(), k = a.cols();
+    for (std::size_t i = 0; i < m; i++) {
+        scale(beta, c.row(i), n);
+    }
+
+    for (std::size_t jb = 0; jb < n; jb += NT_BLOCK_N) {
+        auto j_end = std::min(jb + NT_BLOCK_N, n);
+        for (std::size_t kb = 0; kb < k; kb += NT_BLOCK_K) {
+            auto kc = std::min(NT_BLOCK_K, k - kb);
+            for (std::size_t i = 0; i < m; i++) {
+                auto const* a_row = a.row(i) + kb;
+                auto* c_row = c.row(i);
+                for (std::size_t j = jb; j < j_end; j++) {
+                    c_row[j] += alpha * kernels::dot(a_row, b.row(j) + kb, kc);
+                }
+            }
+        }
+    }
+}
+
+void gemm_nt(Matrix const& a, HalfMatrix const& b, Matrix& c, float alpha, float beta) {
+    auto m = a.rows(), n = b.rows(), k = a.cols();
+    for (std::size_t i = 0; i < m; i++) {
+        scale(beta, c.row(i), n);
+    }
+
+    for (std::size_t jb = 0; jb < n; jb += NT_BLOCK_N) {
+        auto j_end = std::min(jb + NT_BLOCK_N, n);
+        for (std::size_t kb = 0; kb < k; kb += NT_BLOCK_K) {
+            auto kc = std::min(NT_BLOCK_K, k - kb);
+            for (std::size_t i = 0; i < m; i++) {
+                auto const* a_row = a.row(i) + kb;
+                auto* c_row = c.row(i);
+                for (std::size_t j = jb; j < j_end; j++) {
+                    c_row[j] += alpha * kernels::dot_half(b.format(), a_row, b.row(j) + kb, kc);
+                }
+            }
+        }
+    }
+}
+
+void gemm_tn(Matrix const& a, Matrix const& b, Matrix& c, float alpha, float beta) {
+    auto m = a.cols(), n = b.cols(), k = a.rows();
+    for (std::size_t nb = 0; nb < n; nb += BLOCK_N) {
+        auto nc = std::min(BLOCK_N, n - nb);
+        for (std::size_t i = 0; i < m; i++) {
+            auto* c_row = c.row(i) + nb;
+            scale(beta, c_row, nc);
+            for (std::size_t p = 0; p < k; p++) {
+                auto factor = alpha * a(p, i);
+                if (factor == 0.0f) continue;
+                kernels::axpy(factor, b.row(p) + nb, c_row, nc);
+            }
+        }
+    }
+}
+
+void gemm_nn(Matrix const& a, Matrix const& b, Matrix& c, float alpha, float beta) {
+    auto m = a.rows(), n = b.cols(), k = a.cols();
+    for (std::size_t nb = 0; nb < n; nb += BLOCK_N) {
+        auto nc = std::min(BLOCK_N, n - nb);
+        for (std::size_t i = 0; i < m; i++) {
+            auto* c_row = c.row(i) + nb;
+            scale(beta, c_row, nc);
+            auto const* a_row = a.row(i);
+            for (std::size_t p = 0; p < k; p++) {
+                if (a_row[p] == 0.0f) continue;
+                kernels::axpy(alpha * a_row[p], b.row(p) + nb, c_row, nc);
+            }
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "kernels.hpp"
+
+using WeightFormat = kernels::WeightFormat;
+
+enum class MemoryHint {
+    Default,
+    HugePages,
+};
+
+class Matrix {
+public:
+    static constexpr std::size_t ALIGNMENT = 64;
+    static constexpr std::size_t ROW_ALIGNMENT = ALIGNMENT / sizeof(float);
+
+    Matrix() = default;
+    Matrix(std::size_t rows, std::size_t cols, MemoryHint hint = MemoryHint::Default);
+    Matrix(Matrix const& other);
+    Matrix(Matrix&& other) noexcept;
+    Matrix& operator=(Matrix const& other);
+    Matrix& operator=(Matrix&& other) noexcept;
+
+    // Non-owning matrix over externally managed memory (e.g. a mapped file);
+    // `owner` keeps that memory alive. Copies of a view are regular owning matrices.
+    static Matrix view(float* data, std::size_t rows, std::size_t cols, std::size_t stride, std::shared_ptr<void> owner);
+
+    float* row(std::size_t j) { return data_ + j * stride_; }
+    float const* row(std::size_t j) const { return data_ + j * stride_; }
+    float& operator()(std::size_t j, std::size_t i) { return data_[j * stride_ + i]; }
+    float operator()(std::size_t j, std::size_t i) const { return data_[j * stride_ + i]; }
+
+    float* data() { return data_; }
+    float const* data() const { return data_; }
+    std::size_t rows() const { return rows_; }
+    std::size_t cols() const { return cols_; }
+    std::size_t stride() const { return stride_; }
+    std::size_t storage_size() const { return rows_ * stride_; }
+    bool empty() const { return rows_ == 0 || cols_ == 0; }
+
+    void fill(float value);
+    // Reuses the current allocation when it is large enough; contents are unspecified afterwards.
+    void resize(std::size_t rows, std::size_t cols);
+
+private:
+    std::size_t rows_ = 0;
+    std::size_t cols_ = 0;
+    std::size_t stride_ = 0;
+    std::size_t capacity_ = 0;
+    MemoryHint hint_ = MemoryHint::Default;
+    std::shared_ptr<float> storage_;
+    float* data_ = nullptr;
+
+    void allocate();
+};
+
+// Weights stored as bf16 or fp16 bit patterns, rows padded like Matrix rows.
+// The allocation has slack past the last row so the half gathers may read
+// one element beyond it.
+class HalfMatrix {
+public:
+    static constexpr std::size_t ROW_ALIGNMENT = Matrix::ALIGNMENT / sizeof(std::uint16_t);
+
+    HalfMatrix() = default;
+    HalfMatrix(WeightFormat format, std::size_t rows, std::size_t cols);
+    HalfMatrix(HalfMatrix const& other);
+    HalfMatrix(HalfMatrix&& other) noexcept = default;
+    HalfMatrix& operator=(HalfMatrix const& other);
+    HalfMatrix& operator=(HalfMatrix&& other) noexcept = default;
+
+    // Same contract as Matrix::view; `data` must be followed by at least one
+    // readable element.
+    static HalfMatrix view(
+        WeightFormat format,
+        std::uint16_t* data,
+        std::size_t rows,
+        std::size_t cols,
+        std::size_t stride,
+        std::shared_ptr<void> owner
+    );
+    static HalfMatrix from_float(WeightFormat format, Matrix const& source);
+
+    std::uint16_t* row(std::size_t j) { return data_ + j * stride_; }
+    std::uint16_t const* row(std::size_t j) const { return data_ + j * stride_; }
+    std::uint16_t& operator()(std::size_t j, std::size_t i) { return data_[j * stride_ + i]; }
+
+    WeightFormat format() const { return format_; }
+    std::uint16_t const* data() const { return data_; }
+    std::size_t rows() const { return rows_; }
+    std::size_t cols() const { return cols_; }
+    std::size_t stride() const { return stride_; }
+    std::size_t storage_size() const { return rows_ * stride_; }
+    bool empty() const { return rows_ == 0 || cols_ == 0; }
+
+    // Rounds rows [first_row, last_row) of a same-shaped fp32 matrix into this one.
+    void assign(Matrix const& source, std::size_t first_row, std::size_t last_row);
+    Matrix to_float() const;
+
+private:
+    WeightFormat format_ = WeightFormat::BFloat16;
+    std::size_t rows_ = 0;
+    std::size_t cols_ = 0;
+    std::size_t stride_ = 0;
+    std::shared_ptr<std::uint16_t> storage_;
+    std::uint16_t* data_ = nullptr;
+};
+
+// C = alpha * A * B^T + beta * C, with A: m x k, B: n x k, C: m x n
+void gemm_nt(Matrix const& a, Matrix const& b, Matrix& c, float alpha = 1.0f, float beta = 0.0f);
+void gemm_nt(Matrix const& a, HalfMatrix const& b, Matrix& c, float alpha = 1.0f, float beta = 0.0f);
+// C = alpha * A^T * B + beta * C, with A: k x m, B: k x n, C: m x n
+void gemm_tn(Matrix const& a, Matrix const& b, Matrix& c, float alpha = 1.0f, float beta = 0.0f);
+// C = alpha * A * B + beta * C, with A: m x k, B: k x n, C: m x n
+void gemm_nn(Matrix const& a, Matrix const& b, Matrix& c, float alpha = 1.0f, float beta = 0.0f);
@@ -1,5 +1,9 @@
 #include "nn.hpp"
 #include "utils.hpp"
+#include "kernels.hpp"
+#include "threadPool.hpp"
+#include "batchStream.hpp"
+#include "checkpointWriter.hpp"
 #include <random>
 #include <iostream>
 #include <sstream>
@@ -12,166 +16,620 @@ Layer::Layer(
     ActivationFunction activation,
     ActivationFunction derivative
 )
-    : in_size_(in_size),
+    : weights_(out_size, in_size, MemoryHint::HugePages),
+    biases_(out_size),
+    in_size_(in_size),
     out_size_(out_size),
     activation_(activation),
     activation_derivative_(derivative)
 {
+    randomize();
+}
+
+Layer::Layer(LayerGeometry geometry, ActivationFunction activation, ActivationFunction derivative):
+    biases_(geometry.kind == LayerKind::Conv2D ? geometry.output.channels : 0),
+    geometry_(geometry),
+    in_size_(geometry.input.size()),
+    out_size_(geometry.output.size()),
+    activation_(geometry.kind == LayerKind::Conv2D ? activation : nullptr),
+    activation_derivative_(geometry.kind == LayerKind::Conv2D ? derivative : nullptr) {
+    if (geometry.kind == LayerKind::Conv2D) {
+        weights_ = Matrix(geometry.output.channels, geometry.patch_size());
+    }
+    randomize();
+}
+
+Layer::Layer(WeightConfig config):
+    weights_(std::move(config.weights)),
+    half_weights_(std::move(config.half_weights)),
+    format_(config.format),
+    biases_(std::move(config.biases)),
+    geometry_(config.geometry),
+    in_size_(!geometry_.is_dense() ? geometry_.input.size() : weights_.empty() ? half_weights_.cols() : weights_.cols()),
+    out_size_(!geometry_.is_dense() ? geometry_.output.size() : weights_.empty() ? half_weights_.rows() : weights_.rows()),
+    activation_(config.function),
+    activation_derivative_(config.derivative) {
+    if (is_half() && half_weights_.empty()) {
+        half_weights_ = HalfMatrix::from_float(format_, weights_);
+    }
+}
+
+void Layer::randomize() {
     static std::random_device rd;
     static auto gen = std::mt19937(rd());
     static auto normal = std::normal_distribution<float>(INIT_MEAN, INIT_DEVIATION);
 
-    for (std::size_t _j = 0; _j < out_size; _j++) {
-        std::vector<float> sub_weight, grad_subw;
-        for (std::size_t _i = 0; _i < in_size; _i++) {
-            sub_weight.push_back(normal(gen)); 
-            grad_subw.push_back(0.0f);
+    for (std::size_t j = 0; j < weights_.rows(); j++) {
+        auto* row = weights_.row(j);
+        for (std::size_t i = 0; i < weights_.cols(); i++) {
+            row[i] = normal(gen);
         }
-        weights_.push_back(sub_weight);
-        biases_.push_back(normal(gen));
-        weight_gradient_.push_back(grad_subw);
-        bias_gradient_.push_back(0.0f);
-        node_gradient_.push_back(0.0f);
+        biases_[j] = normal(gen);
     }
 }
 
-Layer::Layer(WeightConfig const& config):
-    in_size_(config.weights[0].size()),
-    out_size_(config.weights.size()),
-    activation_(config.function),
-    activation_derivative_(config.derivative) {
+std::size_t Layer::weight_cols() const {
+    return geometry_.is_dense() ? in_size_ : weights_.cols();
+}
 
-    node_gradient_.assign(out_size_, 0.0f);
-    bias_gradient_.assign(out_size_, 0.0f);
+void Layer::set_weight_format(WeightFormat format) {
+    if (format == format_ || !geometry_.is_dense()) return;
+    ensure_master();
+    format_ = format;
+    half_weights_ = is_half() ? HalfMatrix::from_float(format_, weights_) : HalfMatrix();
+}
 
-    for (std::size_t _i = 0; _i < out_size_; _i++) {
-        weight_gradient_.push_back(std::vector<float>(in_size_, 0.0f));
+void Layer::ensure_master() {
+    if (weights_.empty() && !half_weights_.empty()) {
+        weights_ = half_weights_.to_float();
     }
+}
 
-    biases_ = config.biases;
-    weights_ = config.weights;
+void Layer::release_master() {
+    if (is_half()) {
+        weights_ = Matrix();
+    }
 }
 
-std::vector<float> Layer::sum_inputs(std::vector<float> const& previous) const {
-    std::vector<float> result;
+void Layer::sync_half(std::size_t first_row, std::size_t last_row) {
+    if (is_half()) {
+        half_weights_.assign(weights_, first_row, last_row);
+    }
+}
+
+void Layer::sum_inputs(float const* previous, float* result) const {
+    if (!geometry_.is_dense()) {
+        // One-row views; the batch pass finds `sums` already shaped and keeps it.
+        auto image = Matrix::view(const_cast<float*>(previous), 1, in_size_, in_size_, nullptr);
+        auto sums = Matrix::view(result, 1, out_size_, out_size_, nullptr);
+        sum_inputs(image, sums);
+        return;
+    }
     for (std::size_t j = 0; j < out_size_; j++) {
-        auto sum = biases_[j];
-        for (std::size_t i = 0; i < in_size_; i++) {
-            sum += weights_[j][i] * previous[i];
+        auto sum = is_half()
+            ? kernels::dot_half(format_, previous, half_weights_.row(j), in_size_)
+            : kernels::dot(weights_.row(j), previous, in_size_);
+        result[j] = biases_[j] + sum;
+    }
+}
+
+void Layer::apply_activation(float* values) const {
+    if (activation_ == nullptr) return;
+    if (activation_ == ReLu) {
+        ReLuActivation::apply(values, out_size_);
+        return;
+    }
+    if (activation_ == sigm) {
+        SigmoidActivation::apply(values, out_size_);
+        return;
+    }
+    if (activation_ == fast_sigm) {
+        FastSigmoidActivation::apply(values, out_size_);
+        return;
+    }
+    for (std::size_t j = 0; j < out_size_; j++) {
+        values[j] = activation_(values[j]);
+    }
+}
+
+void Layer::forward_pass(float const* previous, float* result) const {
+    sum_inputs(previous, result);
+    apply_activation(result);
+}
+
+void Layer::sum_inputs(Matrix const& previous, Matrix& result) const {
+    if (geometry_.kind == LayerKind::Conv2D) {
+        convolve(previous, result);
+        return;
+    }
+    if (geometry_.kind == LayerKind::MaxPool2D) {
+        pool(previous, result);
+        return;
+    }
+    result.resize(previous.rows(), out_size_);
+    if (is_half()) {
+        gemm_nt(previous, half_weights_, result);
+    } else {
+        gemm_nt(previous, weights_, result);
+    }
+    for (std::size_t b = 0; b < result.rows(); b++) {
+        auto* row = result.row(b);
+        for (std::size_t j = 0; j < out_size_; j++) {
+            row[j] += biases_[j];
+        }
+    }
+}
+
+void Layer::forward_pass(Matrix const& previous, Matrix& result) const {
+    sum_inputs(previous, result);
+    for (std::size_t b = 0; b < result.rows(); b++) {
+        apply_activation(result.row(b));
+    }
+}
+
+void Layer::forward_pass(Matrix const& previous, Matrix& sums, Matrix& values) const {
+    sum_inputs(previous, sums);
+    activate(sums, values);
+}
+
+void Layer::activate(Matrix const& sums, Matrix& values) const {
+    values.resize(sums.rows(), out_size_);
+    std::copy(sums.data(), sums.data() + sums.rows() * sums.stride(), values.data());
+    for (std::size_t b = 0; b < values.rows(); b++) {
+        apply_activation(values.row(b));
+    }
+}
+
+void Layer::sum_inputs(ActivePixels const& previous, Matrix& result) const {
+    if (!geometry_.is_dense()) {
+        std::cerr << "Only dense layers take sparse batches\n";
+        exit(1);
+    }
+    result.resize(previous.rows(), out_size_);
+    for (std::size_t j = 0; j < out_size_; j++) {
+        for (std::size_t b = 0; b < previous.rows(); b++) {
+            auto sum = is_half()
+                ? kernels::gather_sum_half(format_, half_weights_.row(j), previous.row(b), previous.row_size(b))
+                : kernels::gather_sum(weights_.row(j), previous.row(b), previous.row_size(b));
+            result(b, j) = biases_[j] + sum;
         }
-        result.push_back(sum);
     }
-    return result;
 }
 
-std::vector<float> Layer::forward_pass(std::vector<float> const& previous) const {
-    auto weighted_sums = sum_inputs(previous);
-    for (auto& val: weighted_sums) {
-        val = activation_(val);
+void Layer::forward_pass(ActivePixels const& previous, Matrix& result) const {
+    sum_inputs(previous, result);
+    for (std::size_t b = 0; b < result.rows(); b++) {
+        apply_activation(result.row(b));
     }
-    return weighted_sums;
 }
 
-std::vector<float> const& Layer::get_node_gradient() const {
-    return node_gradient_;
+void Layer::forward_pass(ActivePixels const& previous, Matrix& sums, Matrix& values) const {
+    sum_inputs(previous, sums);
+    activate(sums, values);
 }
 
-std::vector<std::vector<float>> const& Layer::get_weights() const {
+Matrix const& Layer::get_weights() const {
     return weights_;
 }
 
+Matrix Layer::float_weights() const {
+    return weights_.empty() && is_half() ? half_weights_.to_float() : weights_;
+}
+
+HalfMatrix const& Layer::get_half_weights() const {
+    return half_weights_;
+}
+
+WeightFormat Layer::get_weight_format() const {
+    return format_;
+}
+
 std::vector<float> const& Layer::get_bias_weights() const {
     return biases_;
 }
 
-void Layer::calculate_out_layer_grad(
-        std::vector<float> const& output_diff,
-        std::vector<float> const& summed_out,
-        std::vector<float> const& incoming_values
-) {
-    for (unsigned int j = 0; j < 5; j++) {
-        constexpr float constant = -(2.0f / 5.0f);
-        float acti_derr = activation_derivative_(summed_out[j]);
-        float common_factor = constant * output_diff[j] * acti_derr;
+std::size_t Layer::get_in_size() const {
+    return in_size_;
+}
 
-        for (unsigned int i = 0; i < 128; i++) {
-            weight_gradient_[j][i] = common_factor * incoming_values[i];
-        }
+std::size_t Layer::get_out_size() const {
+    return out_size_;
+}
+
+ActivationFunction Layer::get_activation() const {
+    return activation_;
+}
+
+LayerGeometry const& Layer::get_geometry() const {
+    return geometry_;
+}
+
+std::size_t Layer::memory_size() const {
+    auto weight_bytes = is_half() ? sizeof(std::uint16_t) : sizeof(float);
+    return biases_.size() * (weight_cols() * weight_bytes + sizeof(float));
+}
 
-        bias_gradient_[j] = common_factor;
-        node_gradient_[j] = constant * output_diff[j];
+// Output positions per im2col block: the block's unrolled patches stay in
+// cache while every output channel is computed from them.
+static constexpr std::size_t CONVOLUTION_BLOCK = 1024;
+
+// Calls visit(first_row, last_row, maps) for blocks of whole output rows,
+// `maps` viewing the block's part of the feature maps in one batch row
+// (one channel per row).
+template<typename Visit>
+static void for_each_row_block(LayerGeometry const& geometry, float const* maps, Visit const& visit) {
+    auto const& out = geometry.output;
+    auto rows_per_block = std::max<std::size_t>(1, CONVOLUTION_BLOCK / out.width);
+    for (std::size_t first = 0; first < out.height; first += rows_per_block) {
+        auto last = std::min(first + rows_per_block, out.height);
+        auto* block = const_cast<float*>(maps) + first * out.width;
+        auto view = Matrix::view(block, out.channels, (last - first) * out.width, out.area(), nullptr);
+        visit(first, last, view);
     }
 }
 
-void Layer::calculate_second_layer_grad(
-    std::vector<float> const& layer0_vals,
-    std::vector<float> const& sums,
-    std::vector<float> const& out_wsum,
-    std::vector<std::vector<float>> const& out_weights,
-    std::vector<float> const& out_grad
-) {
-    for (unsigned int j = 0; j < 128; j++) {
-        float next_layer_sum = 0.0f;
-        for (unsigned int n = 0; n < 5; n++) {
-            next_layer_sum += out_weights[n][j] * sigm_derivative(out_wsum[n]) * out_grad[n];
+void Layer::convolve(Matrix const& previous, Matrix& result) const {
+    thread_local Matrix columns;
+    result.resize(previous.rows(), out_size_);
+    for (std::size_t b = 0; b < previous.rows(); b++) {
+        for_each_row_block(geometry_, result.row(b), [&](std::size_t first, std::size_t last, Matrix& maps) {
+            im2col(geometry_, previous.row(b), first, last, columns);
+            gemm_nn(weights_, columns, maps);
+            for (std::size_t c = 0; c < maps.rows(); c++) {
+                auto* map = maps.row(c);
+                for (std::size_t p = 0; p < maps.cols(); p++) {
+                    map[p] += biases_[c];
+                }
+            }
+        });
+    }
+}
+
+void Layer::pool(Matrix const& previous, Matrix& result) const {
+    result.resize(previous.rows(), out_size_);
+    for (std::size_t b = 0; b < previous.rows(); b++) {
+        max_pool(geometry_, previous.row(b), result.row(b));
+    }
+}
+
+void Layer::convolution_gradient(Matrix const& delta, Matrix const& incoming, float scale, Matrix& weights, float* biases) const {
+    thread_local Matrix columns;
+    for (std::size_t b = 0; b < delta.rows(); b++) {
+        for_each_row_block(geometry_, delta.row(b), [&](std::size_t first, std::size_t last, Matrix const& maps) {
+            im2col(geometry_, incoming.row(b), first, last, columns);
+            gemm_nt(maps, columns, weights, scale, 1.0f);
+            for (std::size_t c = 0; c < maps.rows(); c++) {
+                auto const* map = maps.row(c);
+                float sum = 0.0f;
+                for (std::size_t p = 0; p < maps.cols(); p++) {
+                    sum += map[p];
+                }
+                biases[c] += scale * sum;
+            }
+        });
+    }
+}
+
+LayerGradient Layer::make_gradient() const {
+    return {
+        Matrix(0, weight_cols(), MemoryHint::HugePages),
+        std::vector<float>(biases_.size(), 0.0f),
+        nullptr,
+        {},
+        {},
+    };
+}
+
+void Layer::compute_delta(LayerGradient& gradient, Matrix const& sums, Matrix const& values) const {
+    auto const& node = gradient.node;
+    gradient.delta.resize(node.rows(), out_size_);
+    for (std::size_t b = 0; b < node.rows(); b++) {
+        auto const* node_row = node.row(b);
+        auto const* sums_row = sums.row(b);
+        auto const* values_row = values.row(b);
+        auto* delta_row = gradient.delta.row(b);
+        if (activation_derivative_ == nullptr) {
+            std::copy(node_row, node_row + out_size_, delta_row);
+        } else if (activation_derivative_ == ReLu_derivative) {
+            activation_delta<ReLuActivation>(sums_row, values_row, node_row, delta_row, out_size_);
+        } else if (activation_derivative_ == sigm_derivative) {
+            activation_delta<SigmoidActivation>(sums_row, values_row, node_row, delta_row, out_size_);
+        } else if (activation_derivative_ == fast_sigm_derivative) {
+            activation_delta<FastSigmoidActivation>(sums_row, values_row, node_row, delta_row, out_size_);
+        } else {
+            for (std::size_t j = 0; j < out_size_; j++) {
+                delta_row[j] = activation_derivative_(sums_row[j]) * node_row[j];
+            }
         }
+    }
+}
 
-        for (unsigned int i = 0; i < 256; i++) {
-            weight_gradient_[j][i] = layer0_vals[i] * activation_derivative_(sums[j]) * next_layer_sum;
+void Layer::reset_gradient(LayerGradient& gradient, ActiveColumns const* columns) const {
+    if (columns != nullptr) {
+        gradient.columns = &columns->columns;
+        gradient.weights.resize(columns->columns.size(), out_size_);
+        gradient.weights.fill(0.0f);
+    } else if (geometry_.is_dense()) {
+        // gemm_tn overwrites the dense gradient, so it needs no clearing.
+        gradient.columns = nullptr;
+        gradient.weights.resize(out_size_, in_size_);
+    } else {
+        // Convolutions add up one image at a time.
+        gradient.columns = nullptr;
+        gradient.weights.resize(biases_.size(), weight_cols());
+        gradient.weights.fill(0.0f);
+    }
+    std::fill(gradient.biases.begin(), gradient.biases.end(), 0.0f);
+}
+
+void Layer::accumulate_gradient(LayerGradient& gradient, float scale, Matrix const& incoming) const {
+    auto const& delta = gradient.delta;
+    if (!geometry_.is_dense()) {
+        if (geometry_.kind == LayerKind::Conv2D) {
+            convolution_gradient(delta, incoming, scale, gradient.weights, gradient.biases.data());
         }
+        return;
+    }
+    gemm_tn(delta, incoming, gradient.weights, scale);
 
-        bias_gradient_[j] = activation_derivative_(sums[j]) * next_layer_sum;
-        node_gradient_[j] = next_layer_sum;
+    for (std::size_t b = 0; b < delta.rows(); b++) {
+        kernels::axpy(scale, delta.row(b), gradient.biases.data(), out_size_);
     }
 }
 
-void Layer::calculate_first_layer_grad(
-    std::vector<float> const& image,
-    std::vector<float> const& layer0_sum,
-    std::vector<float> const& layer1_sum,
-    std::vector<std::vector<float>> const& weights_l1,
-    std::vector<float> const& layer1_grad
-) {
-    for (unsigned int j = 0; j < 256; j++) {
-        float next_layer_sum = 0.0f;
-        for (unsigned int n = 0; n < 126; n++) {
-            next_layer_sum += weights_l1[n][j] * activation_derivative_(layer1_sum[n]) * layer1_grad[n];
+// Binary inputs: d(loss)/dW[j][i] = sum over images with pixel i set of delta[b][j],
+// so only the active columns get a gradient row.
+void Layer::accumulate_gradient(
+    LayerGradient& gradient,
+    float scale,
+    ActivePixels const& incoming,
+    ActiveColumns const& columns
+) const {
+    auto const& delta = gradient.delta;
+    for (std::size_t b = 0; b < incoming.rows(); b++) {
+        auto const* pixels = incoming.row(b);
+        for (std::size_t k = 0; k < incoming.row_size(b); k++) {
+            kernels::axpy(scale, delta.row(b), gradient.weights.row(columns.position[pixels[k]]), out_size_);
         }
+    }
+
+    for (std::size_t b = 0; b < delta.rows(); b++) {
+        kernels::axpy(scale, delta.row(b), gradient.biases.data(), out_size_);
+    }
+}
 
-        for (unsigned int i = 0; i < 65536; i++) {
-            weight_gradient_[j][i] = image[i] * activation_derivative_(layer0_sum[j]) * next_layer_sum;
+void Layer::calculate_gradient(
+    LayerGradient& gradient,
+    float scale,
+    Matrix const& sums,
+    Matrix const& values,
+    Matrix const& incoming
+) const {
+    compute_delta(gradient, sums, values);
+    accumulate_gradient(gradient, scale, incoming);
+}
+
+void Layer::calculate_gradient(
+    LayerGradient& gradient,
+    float scale,
+    Matrix const& sums,
+    Matrix const& values,
+    ActivePixels const& incoming,
+    ActiveColumns const& columns
+) const {
+    compute_delta(gradient, sums, values);
+    accumulate_gradient(gradient, scale, incoming, columns);
+}
+
+void Layer::apply_delta(LayerGradient const& gradient, float rate, Matrix const& incoming) {
+    auto const& delta = gradient.delta;
+    if (!geometry_.is_dense()) {
+        if (geometry_.kind == LayerKind::Conv2D) {
+            convolution_gradient(delta, incoming, -rate, weights_, biases_.data());
         }
+        return;
+    }
+    // A single image is an outer product; the kernel skips outputs whose
+    // delta is zero, which ReLU makes common.
+    if (delta.rows() == 1) {
+        kernels::rank1_update(-rate, delta.row(0), out_size_, incoming.row(0), in_size_, weights_.data(), weights_.stride());
+    } else {
+        gemm_tn(delta, incoming, weights_, -rate, 1.0f);
+    }
+    if (is_half()) {
+        // Only rows with a nonzero delta changed; re-round those, a run at a time.
+        auto touched = [&](std::size_t j) {
+            for (std::size_t b = 0; b < delta.rows(); b++) {
+                if (delta(b, j) != 0.0f) return true;
+            }
+            return false;
+        };
+        for (std::size_t j = 0; j < out_size_;) {
+            if (!touched(j)) {
+                j++;
+                continue;
+            }
+            auto first = j;
+            while (j < out_size_ && touched(j)) j++;
+            sync_half(first, j);
+        }
+    }
+    for (std::size_t b = 0; b < delta.rows(); b++) {
+        kernels::axpy(-rate, delta.row(b), biases_.data(), out_size_);
+    }
+}
 
-        bias_gradient_[j] = activation_derivative_(layer0_sum[j]) * next_layer_sum;
+void Layer::apply_delta(LayerGradient const& gradient, float rate, ActivePixels const& incoming) {
+    static constexpr std::size_t ROW_BLOCK = 16;
+    auto const& delta = gradient.delta;
+    for (std::size_t b = 0; b < incoming.rows(); b++) {
+        auto const* pixels = incoming.row(b);
+        auto const* delta_row = delta.row(b);
+        for (std::size_t jb = 0; jb < out_size_; jb += ROW_BLOCK) {
+            auto j_end = std::min(jb + ROW_BLOCK, out_size_);
+            for (std::size_t k = 0; k < incoming.row_size(b); k++) {
+                for (std::size_t j = jb; j < j_end; j++) {
+                    weights_(j, pixels[k]) -= rate * delta_row[j];
+                }
+            }
+            if (!is_half()) continue;
+            for (std::size_t k = 0; k < incoming.row_size(b); k++) {
+                for (std::size_t j = jb; j < j_end; j++) {
+                    half_weights_(j, pixels[k]) = kernels::to_half(format_, weights_(j, pixels[k]));
+                }
+            }
+        }
+        kernels::axpy(-rate, delta_row, biases_.data(), out_size_);
     }
 }
 
-void Layer::update_gradient(float learning_rate) {
-    for (unsigned int j = 0; j < weights_.size(); j++) {
-        for (unsigned int i = 0; i < weights_[0].size(); i++) {
-            weights_[j][i] -= learning_rate * weight_gradient_[j][i];
+void Layer::backpropagate(LayerGradient const& gradient, Matrix const& incoming, Matrix& previous_node) const {
+    auto const& delta = gradient.delta;
+    previous_node.resize(delta.rows(), in_size_);
+    if (geometry_.kind == LayerKind::Conv2D) {
+        thread_local Matrix columns;
+        for (std::size_t b = 0; b < delta.rows(); b++) {
+            auto* image = previous_node.row(b);
+            std::fill(image, image + in_size_, 0.0f);
+            for_each_row_block(geometry_, delta.row(b), [&](std::size_t first, std::size_t last, Matrix const& maps) {
+                columns.resize(geometry_.patch_size(), maps.cols());
+                gemm_tn(weights_, maps, columns);
+                col2im(geometry_, columns, first, last, image);
+            });
+        }
+    } else if (geometry_.kind == LayerKind::MaxPool2D) {
+        for (std::size_t b = 0; b < delta.rows(); b++) {
+            max_pool_backward(geometry_, incoming.row(b), delta.row(b), previous_node.row(b));
         }
-        biases_[j] -= learning_rate * bias_gradient_[j];
+    } else {
+        gemm_nn(delta, weights_, previous_node);
     }
 }
 
-void Layer::reset_gradient() {
-    for (auto& sub_vec: weight_gradient_) {
-        sub_vec.assign(sub_vec.size(), 0.0f);
+void Layer::set_update_rule(UpdateRule rule) {
+    if (rule == update_rule_) return;
+    update_rule_ = rule;
+    bool first = rule != UpdateRule::Sgd;
+    bool second = rule == UpdateRule::Adam;
+    auto rows = biases_.size();
+    moment1_ = first ? Matrix(rows, weight_cols(), MemoryHint::HugePages) : Matrix();
+    moment2_ = second ? Matrix(rows, weight_cols(), MemoryHint::HugePages) : Matrix();
+    bias_moment1_.assign(first ? rows : 0, 0.0f);
+    bias_moment2_.assign(second ? rows : 0, 0.0f);
+}
+
+static float* state_at(float* state, std::size_t offset) {
+    return state == nullptr ? nullptr : state + offset;
+}
+
+static float* state_at(std::vector<float>& state, std::size_t offset) {
+    return state.empty() ? nullptr : state.data() + offset;
+}
+
+void Layer::update_gradient(LayerGradient const& gradient, kernels::UpdateParams const& params) {
+    update_gradient(gradient, params, 0, biases_.size());
+}
+
+void Layer::update_gradient(
+    LayerGradient const& gradient,
+    kernels::UpdateParams const& params,
+    std::size_t first_row,
+    std::size_t last_row
+) {
+    auto stride = weights_.stride();
+    auto* m = moment1_.data();
+    auto* v = moment2_.data();
+    if (gradient.columns != nullptr && params.rule == UpdateRule::Sgd) {
+        // Tiles of ROW_BLOCK rows by COLUMN_BLOCK columns: the gradient tile
+        // stays in L1 while each weight row is walked in increasing column
+        // order. Walking a column down the rows instead would hit one cache
+        // set over and over, as the row stride is a power of two.
+        static constexpr std::size_t ROW_BLOCK = 16;
+        static constexpr std::size_t COLUMN_BLOCK = 64;
+        auto const& columns = *gradient.columns;
+        for (std::size_t jb = first_row; jb < last_row; jb += ROW_BLOCK) {
+            auto j_end = std::min(jb + ROW_BLOCK, last_row);
+            for (std::size_t kb = 0; kb < columns.size(); kb += COLUMN_BLOCK) {
+                auto k_end = std::min(kb + COLUMN_BLOCK, columns.size());
+                for (std::size_t j = jb; j < j_end; j++) {
+                    auto* row = weights_.row(j);
+                    for (std::size_t k = kb; k < k_end; k++) {
+                        row[columns[k]] -= params.rate * gradient.weights(k, j);
+                    }
+                }
+            }
+            if (!is_half()) continue;
+            for (auto column: columns) {
+                for (std::size_t j = jb; j < j_end; j++) {
+                    half_weights_(j, column) = kernels::to_half(format_, weights_(j, column));
+                }
+            }
+        }
+    } else if (gradient.columns != nullptr) {
+        // With state every weight moves while its moments are nonzero, so the
+        // gradient is expanded one row at a time and every row takes the same
+        // fused pass as a dense step. Gradient rows hold one column each, so
+        // ROW_BLOCK output rows of them are first transposed into `block`.
+        static constexpr std::size_t ROW_BLOCK = 16;
+        thread_local std::vector<float> block;
+        thread_local std::vector<float> dense_row;
+        auto const& columns = *gradient.columns;
+        auto count = columns.size();
+        block.resize(ROW_BLOCK * count);
+        dense_row.assign(in_size_, 0.0f);
+        for (std::size_t jb = first_row; jb < last_row; jb += ROW_BLOCK) {
+            auto rows = std::min(ROW_BLOCK, last_row - jb);
+            for (std::size_t k = 0; k < count; k++) {
+                auto const* grad_row = gradient.weights.row(k) + jb;
+                for (std::size_t r = 0; r < rows; r++) {
+                    block[r * count + k] = grad_row[r];
+                }
+            }
+            for (std::size_t r = 0; r < rows; r++) {
+                auto const* values = block.data() + r * count;
+                for (std::size_t k = 0; k < count; k++) {
+                    dense_row[columns[k]] = values[k];
+                }
+                auto offset = (jb + r) * stride;
+                kernels::update(params, weights_.row(jb + r), state_at(m, offset), state_at(v, offset), dense_row.data(), in_size_);
+                for (auto column: columns) {
+                    dense_row[column] = 0.0f;
+                }
+            }
+        }
+        sync_half(first_row, last_row);
+    } else {
+        auto offset = first_row * stride;
+        auto count = (last_row - first_row) * stride;
+        kernels::update(params, weights_.data() + offset, state_at(m, offset), state_at(v, offset), gradient.weights.data() + offset, count);
+        sync_half(first_row, last_row);
     }
-    bias_gradient_.assign(bias_gradient_.size(), 0.0f);
-    node_gradient_.assign(node_gradient_.size(), 0.0f);
+    kernels::update(
+        params,
+        biases_.data() + first_row,
+        state_at(bias_moment1_, first_row),
+        state_at(bias_moment2_, first_row),
+        gradient.biases.data() + first_row,
+        last_row - first_row
+    );
 }
 
 NeuralNet::NeuralNet(Config const& config): loss_function_(config.loss_function) {
+    if (!config.features.empty()) {
+        add_features(config);
+    }
     for (std::size_t i = 0; i < config.layers_sizes.size(); i++) {
         auto sizes = config.layers_sizes[i];
+        if (i == 0 && !layers_.empty()) {
+            sizes.first = layers_.back().get_out_size();
+        }
         layers_.push_back({
             sizes.first,
             sizes.second,
             config.functions[i],
             config.derivatives[i]
         });
+        layers_.back().set_weight_format(config.weight_format);
     }
     
     std::size_t idx = 0;
@@ -180,22 +638,63 @@ NeuralNet::NeuralNet(Config const& config): loss_function_(config.loss_function)
     }
 }
 
-NeuralNet::NeuralNet(FileConfig const& config):
+void NeuralNet::add_features(Config const& config) {
+    auto pixels = config.layers_sizes.empty() ? 0 : config.layers_sizes[0].first;
+    auto side = static_cast<std::size_t>(std::lround(std::sqrt(static_cast<double>(pixels))));
+    if (side == 0 || side * side != pixels) {
+        std::cerr << "Convolutions need square images, got " << pixels << " pixels\n";
+        exit(1);
+    }
+    auto map = FeatureMap{1, side, side};
+    for (auto const& feature: config.features) {
+        auto geometry = feature.kind == LayerKind::Conv2D
+            ? LayerGeometry::conv2d(map, feature.channels, feature.kernel, feature.stride, feature.padding)
+            : LayerGeometry::max_pool2d(map, feature.kernel, feature.stride);
+        layers_.push_back(Layer(geometry, feature.function, feature.derivative));
+        map = geometry.output;
+    }
+}
+
+NeuralNet::NeuralNet(FileConfig config):
     loss_function_(config.loss),
-    name_to_index_(config.mapping) {
+    name_to_index_(std::move(config.mapping)) {
 
-    for (auto const& conf: config.layer_data) {
-        layers_.push_back({conf});
+    for (auto& conf: config.layer_data) {
+        layers_.push_back(Layer(std::move(conf)));
     }
     
 }
 
-std::vector<float> NeuralNet::forward_pass(std::vector<float> const& image) const {
-    auto zs = image;
+NeuralNet::Workspace NeuralNet::make_workspace(std::size_t batch_size, bool weight_gradients) const {
+    // The input batch is left to the first fill_batch, which knows whether it is sparse.
+    Workspace workspace;
+    workspace.batch.names.resize(batch_size);
     for (auto const& layer: layers_) {
-        zs = layer.forward_pass(zs);
+        auto outputs = layer.get_out_size();
+        workspace.tape.sums.emplace_back(batch_size, outputs);
+        workspace.tape.values.emplace_back(batch_size, outputs);
+        auto gradient = layer.make_gradient();
+        gradient.node = Matrix(batch_size, outputs);
+        gradient.delta = Matrix(batch_size, outputs);
+        if (weight_gradients) {
+            layer.reset_gradient(gradient, nullptr);
+        }
+        workspace.gradients.push_back(std::move(gradient));
     }
-    return zs;
+    workspace.target.assign(layers_.back().get_out_size(), 0.0f);
+    return workspace;
+}
+
+void NeuralNet::forward_pass(float const* image, float* scores, Workspace& workspace) const {
+    auto& values = workspace.tape.values;
+    values.resize(layers_.size());
+    auto const* input = image;
+    for (std::size_t l = 0; l + 1 < layers_.size(); l++) {
+        values[l].resize(1, layers_[l].get_out_size());
+        layers_[l].forward_pass(input, values[l].row(0));
+        input = values[l].row(0);
+    }
+    layers_.back().forward_pass(input, scores);
 }
 
 
@@ -219,137 +718,541 @@ std::size_t NeuralNet::get_result_index(std::string const& name) const {
     exit(1);
 }
 
-void NeuralNet::learn(Dataset const& dataset, std::size_t L, float learning_rate) {
-    for (unsigned int n = 0; n <= L; n++) {
-        displayProgressBar(n + 1, L + 1);
-        std::size_t record_index = L % dataset.size();
-        update_weigths(learning_rate, dataset[record_index]);
-        reset_gradients();
-        iteration_loss_.push_back(calculate_cost(dataset[record_index]));
-    } 
+bool NeuralNet::has_class(std::string const& name) const {
+    return name_to_index_.count(name) > 0;
 }
 
-float NeuralNet::calculate_cost(Record const& record) const {
-    auto prediction = forward_pass(record.image);
-    auto desired = std::vector<float>(prediction.size(), 0.0f);  
-    auto valid_class_idx = name_to_index_.find(record.name)->second;
-    desired[valid_class_idx] = 1.0f;
-    return loss_function_(prediction, desired);
+std::vector<Layer> const& NeuralNet::get_layers() const {
+    return layers_;
 }
 
-std::vector<float> NeuralNet::get_output_differences(
-    std::vector<float> const& predictions,
-    std::string const& record_name
-) const {
-    auto result = std::vector<float>(predictions.size(), 0.0f);
-    result[get_result_index(record_name)] = 1.0f;
-    for (unsigned int i = 0; i < result.size(); i++) {
-        result[i] -=  predictions[i];
+std::map<std::string, std::size_t> const& NeuralNet::get_mapping() const {
+    return name_to_index_;
+}
+
+Matrix NeuralNet::forward_pass(Matrix const& images) const {
+    Matrix zs, next;
+    auto const* input = &images;
+    for (auto const& layer: layers_) {
+        layer.forward_pass(*input, next);
+        std::swap(zs, next);
+        input = &zs;
     }
-    return result;
+    return zs;
 }
 
-void NeuralNet::update_weigths(float lr, Record const& record) {
-    auto layer0_values = layers_[0].forward_pass(record.image);
-    auto layer1_values = layers_[1].forward_pass(layer0_values);
-    auto predictions = layers_[2].forward_pass(layer1_values);
+Matrix NeuralNet::forward_pass(Batch const& batch) const {
+    Workspace workspace;
+    return forward_pass(batch, workspace);
+}
 
-    auto wsum0 = layers_[0].sum_inputs(record.image);
-    auto wsum1 = layers_[1].sum_inputs(layer0_values);
-    auto out_wsum = layers_[2].sum_inputs(layer1_values);
+Matrix const& NeuralNet::forward_pass(Batch const& batch, Workspace& workspace) const {
+    auto& values = workspace.tape.values;
+    values.resize(layers_.size());
+    if (batch.sparse) {
+        layers_[0].forward_pass(batch.active, values[0]);
+    } else {
+        layers_[0].forward_pass(batch.images, values[0]);
+    }
+    for (std::size_t l = 1; l < layers_.size(); l++) {
+        layers_[l].forward_pass(values[l - 1], values[l]);
+    }
+    return values.back();
+}
 
-    auto const& out_node_grad = layers_[2].get_node_gradient();
-    auto const& out_node_weights = layers_[2].get_weights();
-    auto const& layer1_grad = layers_[1].get_node_gradient(); 
-    auto const& layer1_weigthts = layers_[1].get_weights();
+NeuralNet::Predictions NeuralNet::predict(DatasetView const& records, ThreadPool& pool, std::size_t batch_size) const {
+    auto count = records.size();
+    auto batches = batch_count(count, batch_size);
+    Predictions result;
+    result.scores.resize(count, layers_.back().get_out_size());
+    result.classes.resize(count);
+    if (count == 0) return result;
 
-    auto output_diff = get_output_differences(predictions, record.name);
-    
-    layers_[2].calculate_out_layer_grad(output_diff, out_wsum, layer1_values);
-    layers_[1].calculate_second_layer_grad(layer0_values, wsum1, out_wsum, out_node_weights, out_node_grad);
-    layers_[0].calculate_first_layer_grad(record.image, wsum0, wsum1, layer1_weigthts, layer1_grad);
+    std::vector<std::size_t> named_outputs;
+    for (auto const& [name, index]: name_to_index_) {
+        if (index < result.scores.cols()) named_outputs.push_back(index);
+    }
 
-    for (auto& layer: layers_) {
-        layer.update_gradient(lr);
+    auto sparse_input = layers_[0].get_geometry().is_dense();
+    pool.parallel_for(batches, [&](std::size_t task) {
+        // Pool threads keep their buffers from one prediction to the next.
+        thread_local Workspace workspace;
+        auto first = task * batch_size;
+        auto size = std::min(batch_size, count - first);
+        auto& batch = workspace.batch;
+        fill_batch(batch, records, first, size, sparse_input && is_sparse_batch(records, first, size));
+        auto const& scores = forward_pass(batch, workspace);
+        for (std::size_t b = 0; b < size; b++) {
+            auto const* row = scores.row(b);
+            std::copy(row, row + scores.cols(), result.scores.row(first + b));
+            auto best = named_outputs.empty() ? 0 : named_outputs[0];
+            for (auto index: named_outputs) {
+                if (row[index] > row[best]) best = index;
+            }
+            result.classes[first + b] = best;
+        }
+    });
+    return result;
+}
+
+std::vector<NeuralNet::Workspace> NeuralNet::make_workspaces(ThreadPool const& pool, std::size_t batch_size) const {
+    if (batch_size == 0) {
+        std::cerr << "Training batches need at least one image\n";
+        exit(1);
+    }
+    auto count = std::min(pool.size(), batch_size);
+    auto slice_size = (batch_size + count - 1) / count;
+    // A single slice with plain SGD goes through fused_step, which never fills weight gradients.
+    bool weight_gradients = count > 1 || update_rule_ != UpdateRule::Sgd;
+    std::vector<Workspace> workspaces;
+    for (std::size_t w = 0; w < count; w++) {
+        workspaces.push_back(make_workspace(slice_size, weight_gradients));
     }
+    return workspaces;
 }
 
-void NeuralNet::reset_gradients() {
+void NeuralNet::prepare_optimizer(Optimizer const& optimizer) {
+    if (optimizer.rule != update_rule_) {
+        update_rule_ = optimizer.rule;
+        optimizer_steps_ = 0;
+    }
     for (auto& layer: layers_) {
-        layer.reset_gradient();
+        layer.ensure_master();
+        layer.set_update_rule(optimizer.rule);
     }
 }
 
-float NeuralNet::calculate_total_cost(Dataset const& test) const {
-    float result = 0.0f;
-    for (auto& record: test) {
-        result += calculate_cost(record);
+kernels::UpdateParams NeuralNet::next_update(Optimizer const& optimizer, float learning_rate) {
+    optimizer_steps_++;
+    if (optimizer.rule != UpdateRule::Adam) {
+        return {optimizer.rule, learning_rate, optimizer.momentum, 0.0f, 0.0f};
     }
-    return result;
+    auto t = static_cast<float>(optimizer_steps_);
+    auto correction = std::sqrt(1.0f - std::pow(optimizer.beta2, t)) / (1.0f - std::pow(optimizer.beta1, t));
+    return {optimizer.rule, learning_rate * correction, optimizer.beta1, optimizer.beta2, optimizer.epsilon};
 }
 
-void NeuralNet::dump_weights(std::string const& pathname) const {
-    std::stringstream output;
-    for (std::size_t i = 0; i < layers_.size(); i++) {
-        output << "Layer " << i << '\n';
-        output << "Weights:\n";
-        std::size_t node_index = 0;
-        for (auto const& node_w: layers_[i].get_weights()) {
-            output << "Node " << node_index++ << ": ";
-            for (auto val: node_w) {
-                output << val << ' ';
+std::unique_ptr<CheckpointWriter> NeuralNet::make_checkpoint_writer(TrainConfig const& config) const {
+    bool periodic = config.checkpoint_interval > 0 || config.checkpoint_seconds > 0;
+    if (config.checkpoint_path.empty() || !periodic) return nullptr;
+    return std::make_unique<CheckpointWriter>(config.checkpoint_path);
+}
+
+void NeuralNet::checkpoint_if_due(
+    CheckpointWriter* writer,
+    TrainConfig const& config,
+    std::size_t iteration,
+    TrainingStats::Clock::time_point& last
+) {
+    if (writer == nullptr) return;
+    auto now = TrainingStats::Clock::now();
+    bool due = config.checkpoint_interval > 0 && iteration % config.checkpoint_interval == 0;
+    due |= config.checkpoint_seconds > 0 && std::chrono::duration<double>(now - last).count() >= config.checkpoint_seconds;
+    if (!due) return;
+    auto timer = stats_.time(TrainPhase::Checkpoint);
+    writer->submit(layers_, name_to_index_);
+    last = now;
+}
+
+void NeuralNet::learn(DatasetView const& dataset, TrainConfig const& config) {
+    if (dataset.empty()) {
+        std::cerr << "Cannot train on an empty dataset\n";
+        exit(1);
+    }
+    prepare_optimizer(config.optimizer);
+    auto pool = ThreadPool(config.threads);
+    auto workspaces = make_workspaces(pool, config.batch_size);
+    iteration_loss_.reserve(iteration_loss_.size() + config.iterations + 1);
+    ActiveColumns columns;
+    auto progress = ProgressBar(config.iterations + 1);
+    auto checkpoints = make_checkpoint_writer(config);
+    auto last_checkpoint = TrainingStats::Clock::now();
+
+    // Shuffling reorders a copy of the indices, never the records. Starting
+    // past the end shuffles the first epoch too.
+    auto order = dataset;
+    auto rng = std::mt19937(config.seed);
+    std::size_t position = config.shuffle ? order.size() : 0;
+
+    stats_.begin(pool.size(), config.batch_size);
+    for (unsigned int n = 0; n <= config.iterations; n++) {
+        progress.update(n + 1);
+        if (config.shuffle && position + config.batch_size > order.size()) {
+            order.shuffle(rng);
+            position = 0;
+        }
+        train_step(pool, workspaces, columns, order, position, config.batch_size, config);
+        position += config.batch_size;
+        if (!config.shuffle) position %= order.size();
+        checkpoint_if_due(checkpoints.get(), config, n + 1, last_checkpoint);
+    }
+    if (checkpoints) {
+        auto timer = stats_.time(TrainPhase::Checkpoint);
+        checkpoints->submit(layers_, name_to_index_);
+    }
+    stats_.end();
+    for (auto& layer: layers_) layer.release_master();
+}
+
+void NeuralNet::learn(BatchStream& stream, TrainConfig const& config) {
+    prepare_optimizer(config.optimizer);
+    auto pool = ThreadPool(config.threads);
+    auto workspaces = make_workspaces(pool, config.batch_size);
+    iteration_loss_.reserve(iteration_loss_.size() + config.iterations + 1);
+    ActiveColumns columns;
+    Dataset batch;
+    auto progress = ProgressBar(config.iterations + 1);
+    auto checkpoints = make_checkpoint_writer(config);
+    auto last_checkpoint = TrainingStats::Clock::now();
+
+    stats_.begin(pool.size(), config.batch_size);
+    for (unsigned int n = 0; n <= config.iterations; n++) {
+        progress.update(n + 1);
+        bool has_batch;
+        {
+            auto timer = stats_.time(TrainPhase::Load);
+            has_batch = stream.next(batch);
+        }
+        if (!has_batch) break;
+        train_step(pool, workspaces, columns, batch, 0, batch.size(), config);
+        checkpoint_if_due(checkpoints.get(), config, n + 1, last_checkpoint);
+    }
+    if (checkpoints) {
+        auto timer = stats_.time(TrainPhase::Checkpoint);
+        checkpoints->submit(layers_, name_to_index_);
+    }
+    stats_.end();
+    for (auto& layer: layers_) layer.release_master();
+}
+
+void NeuralNet::train_step(
+    ThreadPool& pool,
+    std::vector<Workspace>& workspaces,
+    ActiveColumns& columns,
+    DatasetView const& dataset,
+    std::size_t first,
+    std::size_t batch_size,
+    TrainConfig const& config
+) {
+    auto slice_size = (batch_size + workspaces.size() - 1) / workspaces.size();
+    auto active = (batch_size + slice_size - 1) / slice_size;
+    float scale = 1.0f / batch_size;
+    bool sparse;
+    {
+        auto timer = stats_.time(TrainPhase::Load);
+        // Convolutions read whole images.
+        sparse = layers_[0].get_geometry().is_dense() && collect_active_columns(columns, dataset, first, batch_size);
+        pool.parallel_for(active, [&](std::size_t w) {
+            auto offset = w * slice_size;
+            fill_batch(workspaces[w].batch, dataset, first + offset, std::min(slice_size, batch_size - offset), sparse);
+        });
+    }
+    stats_.count_step(batch_size, sparse);
+    auto params = next_update(config.optimizer, config.learning_rate);
+
+    if (active == 1) {
+        iteration_loss_.push_back(fused_step(workspaces[0], columns, params, scale) * scale);
+        return;
+    }
+
+    {
+        auto timer = stats_.time(TrainPhase::Forward);
+        pool.parallel_for(active, [&](std::size_t w) {
+            auto& workspace = workspaces[w];
+            record_forward(workspace.batch, workspace.tape);
+            workspace.loss = tape_loss(workspace);
+        });
+    }
+    {
+        auto timer = stats_.time(TrainPhase::Reset);
+        pool.parallel_for(active, [&](std::size_t w) {
+            reset_gradients(workspaces[w].gradients, sparse ? &columns : nullptr);
+        });
+    }
+    {
+        auto timer = stats_.time(TrainPhase::Backward);
+        pool.parallel_for(active, [&](std::size_t w) {
+            auto& workspace = workspaces[w];
+            calculate_gradients(workspace.batch, columns, workspace.tape, workspace.gradients, scale);
+        });
+        reduce_gradients(pool, workspaces, active);
+    }
+    {
+        auto timer = stats_.time(TrainPhase::Update);
+        update_weigths(pool, params, workspaces[0].gradients);
+    }
+
+    float loss = 0.0f;
+    for (std::size_t w = 0; w < active; w++) {
+        loss += workspaces[w].loss;
+    }
+    iteration_loss_.push_back(loss * scale);
+}
+
+// d(MSE)/d(prediction) = 2 / out_size * (prediction - target)
+void NeuralNet::output_gradient(
+    Matrix const& predictions,
+    std::vector<std::string> const& record_names,
+    Matrix& node
+) const {
+    auto factor = 2.0f / predictions.cols();
+    node.resize(predictions.rows(), predictions.cols());
+    for (std::size_t b = 0; b < predictions.rows(); b++) {
+        auto const* prediction = predictions.row(b);
+        auto* row = node.row(b);
+        for (std::size_t i = 0; i < predictions.cols(); i++) {
+            row[i] = factor * prediction[i];
+        }
+        row[get_result_index(record_names[b])] -= factor;
+    }
+}
+
+void NeuralNet::record_forward(Batch const& batch, ForwardTape& tape) const {
+    auto depth = layers_.size();
+    tape.sums.resize(depth);
+    tape.values.resize(depth);
+    if (batch.sparse) {
+        layers_[0].forward_pass(batch.active, tape.sums[0], tape.values[0]);
+    } else {
+        layers_[0].forward_pass(batch.images, tape.sums[0], tape.values[0]);
+    }
+    for (std::size_t l = 1; l < depth; l++) {
+        layers_[l].forward_pass(tape.values[l - 1], tape.sums[l], tape.values[l]);
+    }
+}
+
+float NeuralNet::tape_loss(Workspace& workspace) const {
+    auto const& predictions = workspace.tape.values.back();
+    auto& desired = workspace.target;
+    desired.resize(predictions.cols());
+    float loss = 0.0f;
+    for (std::size_t b = 0; b < predictions.rows(); b++) {
+        std::fill(desired.begin(), desired.end(), 0.0f);
+        desired[get_result_index(workspace.batch.names[b])] = 1.0f;
+        loss += loss_function_(predictions.row(b), desired.data(), predictions.cols());
+    }
+    return loss;
+}
+
+void NeuralNet::reset_gradients(std::vector<LayerGradient>& gradients, ActiveColumns const* columns) const {
+    layers_[0].reset_gradient(gradients[0], columns);
+    for (std::size_t l = 1; l < layers_.size(); l++) {
+        layers_[l].reset_gradient(gradients[l], nullptr);
+    }
+}
+
+void NeuralNet::calculate_gradients(
+    Batch const& batch,
+    ActiveColumns const& columns,
+    ForwardTape const& tape,
+    std::vector<LayerGradient>& gradients,
+    float scale
+) const {
+    auto depth = layers_.size();
+    output_gradient(tape.values.back(), batch.names, gradients[depth - 1].node);
+
+    for (std::size_t l = depth; l-- > 1;) {
+        layers_[l].calculate_gradient(gradients[l], scale, tape.sums[l], tape.values[l], tape.values[l - 1]);
+        layers_[l].backpropagate(gradients[l], tape.values[l - 1], gradients[l - 1].node);
+    }
+    if (batch.sparse) {
+        layers_[0].calculate_gradient(gradients[0], scale, tape.sums[0], tape.values[0], batch.active, columns);
+    } else {
+        layers_[0].calculate_gradient(gradients[0], scale, tape.sums[0], tape.values[0], batch.images);
+    }
+}
+
+// Single-slice steps need no reduction. Plain SGD then puts each layer's
+// outer product straight into its weights (after its delta has been passed
+// down with the old weights), so the weight gradient matrices are never
+// filled; the other rules need the gradient for their state and get it one
+// layer at a time.
+float NeuralNet::fused_step(
+    Workspace& workspace,
+    ActiveColumns const& columns,
+    kernels::UpdateParams const& params,
+    float scale
+) {
+    auto depth = layers_.size();
+    auto const& batch = workspace.batch;
+    auto const& tape = workspace.tape;
+    auto& gradients = workspace.gradients;
+    float loss;
+    {
+        auto timer = stats_.time(TrainPhase::Forward);
+        record_forward(batch, workspace.tape);
+        loss = tape_loss(workspace);
+    }
+    {
+        auto timer = stats_.time(TrainPhase::Backward);
+        output_gradient(tape.values.back(), batch.names, gradients[depth - 1].node);
+    }
+
+    // Backward and update interleave per layer here, so they are timed per layer.
+    if (params.rule == UpdateRule::Sgd) {
+        auto rate = params.rate * scale;
+        auto update = [&](std::size_t l, auto const& incoming) {
+            auto timer = stats_.time(TrainPhase::Update);
+            layers_[l].apply_delta(gradients[l], rate, incoming);
+        };
+        for (std::size_t l = depth; l-- > 1;) {
+            {
+                auto timer = stats_.time(TrainPhase::Backward);
+                layers_[l].compute_delta(gradients[l], tape.sums[l], tape.values[l]);
+                layers_[l].backpropagate(gradients[l], tape.values[l - 1], gradients[l - 1].node);
             }
-            output << '\n';
+            update(l, tape.values[l - 1]);
         }
-        
-        output << "Bias weights:";
-        for (auto b_i: layers_[i].get_bias_weights()) { 
-            output << b_i << ' ';
+        {
+            auto timer = stats_.time(TrainPhase::Backward);
+            layers_[0].compute_delta(gradients[0], tape.sums[0], tape.values[0]);
         }
-        output << '\n';
+        if (batch.sparse) {
+            update(0, batch.active);
+        } else {
+            update(0, batch.images);
+        }
+        return loss;
     }
 
-    auto output_file = std::ofstream(pathname, std::ios::out | std::ios::trunc);
-    if (!output_file.is_open()) {
-        std::cerr << "Weight dump failed!\n";
-        exit(1);
+    auto update = [&](std::size_t l) {
+        auto timer = stats_.time(TrainPhase::Update);
+        layers_[l].update_gradient(gradients[l], params);
+    };
+    for (std::size_t l = depth; l-- > 1;) {
+        {
+            auto timer = stats_.time(TrainPhase::Reset);
+            layers_[l].reset_gradient(gradients[l], nullptr);
+        }
+        {
+            auto timer = stats_.time(TrainPhase::Backward);
+            layers_[l].calculate_gradient(gradients[l], scale, tape.sums[l], tape.values[l], tape.values[l - 1]);
+            layers_[l].backpropagate(gradients[l], tape.values[l - 1], gradients[l - 1].node);
+        }
+        update(l);
     }
-    output_file << output.str();
-    std::cout << "Weights saved\n";
+    {
+        auto timer = stats_.time(TrainPhase::Reset);
+        layers_[0].reset_gradient(gradients[0], batch.sparse ? &columns : nullptr);
+    }
+    {
+        auto timer = stats_.time(TrainPhase::Backward);
+        if (batch.sparse) {
+            layers_[0].calculate_gradient(gradients[0], scale, tape.sums[0], tape.values[0], batch.active, columns);
+        } else {
+            layers_[0].calculate_gradient(gradients[0], scale, tape.sums[0], tape.values[0], batch.images);
+        }
+    }
+    update(0);
+    return loss;
 }
 
-void NeuralNet::dump_predictions(std::string const& dumpdir,std::string const& parentdir, Dataset const& datset) const {   
-    std::vector<std::string> descriptions;
+// Adds chunk `chunk` of `chunks` of from into into. Each vector is cut by its
+// own count of `width`-float rows, so weights and biases split independently.
+static void add_chunk(float const* from, float* into, std::size_t rows, std::size_t width, std::size_t chunk, std::size_t chunks) {
+    auto first = rows * chunk / chunks;
+    auto last = rows * (chunk + 1) / chunks;
+    kernels::axpy(1.0f, from + first * width, into + first * width, (last - first) * width);
+}
 
-    for (std::size_t index = 0; index < datset.size(); index++) {
-        auto image = datset[index].image;
-        auto path = dumpdir + std::to_string(index) + ".ppm";
-        auto img = unflatten_image<256>(image);
-        save_to_ppm(path, img);
+// Pairwise tree reduction of the per-thread gradients into workspaces[0].
+// Round `stride` adds workspace i + stride into i for every i that is a
+// multiple of 2 * stride. Each round's additions are cut into row chunks so
+// every thread has work even when only a few pairs are left.
+void NeuralNet::reduce_gradients(ThreadPool& pool, std::vector<Workspace>& workspaces, std::size_t active) const {
+    for (std::size_t stride = 1; stride < active; stride *= 2) {
+        auto pairs = (active + stride - 1) / (2 * stride);
+        auto chunks = (pool.size() + pairs - 1) / pairs;
+        pool.parallel_for(pairs * chunks, [&](std::size_t task) {
+            auto dst = task / chunks * 2 * stride;
+            auto src = dst + stride;
+            auto chunk = task % chunks;
+            for (std::size_t l = 0; l < layers_.size(); l++) {
+                auto& into = workspaces[dst].gradients[l];
+                auto const& from = workspaces[src].gradients[l];
+                add_chunk(from.weights.data(), into.weights.data(), into.weights.rows(), into.weights.stride(), chunk, chunks);
+                // A sparse gradient has one row per active column, not per output.
+                add_chunk(from.biases.data(), into.biases.data(), into.biases.size(), 1, chunk, chunks);
+            }
+        });
+    }
+}
 
-        auto image_description = "File: " + path + ", Class: " + datset[index].name + '\n';
-        auto pred = forward_pass(image);
-        for (std::size_t i = 0; i < pred.size(); i++) {
-            image_description += get_result_name(i) + ":" + std::to_string(pred[i]) + "\n";
+void NeuralNet::update_weigths(ThreadPool& pool, kernels::UpdateParams const& params, std::vector<LayerGradient> const& gradients) {
+    auto chunks = pool.size();
+    pool.parallel_for(chunks, [&](std::size_t chunk) {
+        for (std::size_t l = 0; l < layers_.size(); l++) {
+            // One bias per weight row, whatever the kind of layer.
+            auto rows = layers_[l].get_bias_weights().size();
+            layers_[l].update_gradient(gradients[l], params, rows * chunk / chunks, rows * (chunk + 1) / chunks);
         }
-        descriptions.push_back(image_description);
+    });
+}
+
+float NeuralNet::calculate_total_cost(DatasetView const& test, ThreadPool& pool) const {
+    auto predictions = predict(test, pool);
+    auto cols = predictions.scores.cols();
+    auto desired = std::vector<float>(cols);
+    float result = 0.0f;
+    for (std::size_t b = 0; b < test.size(); b++) {
+        std::fill(desired.begin(), desired.end(), 0.0f);
+        desired[get_result_index(test[b].name)] = 1.0f;
+        result += loss_function_(predictions.scores.row(b), desired.data(), cols);
     }
-    
-    std::string description_string = "Predictions for files in this directory\n";
-    for (auto& desc: descriptions) {
-        description_string += "\n" + desc + "\n";
+    return result;
+}
+
+void NeuralNet::dump_weights(std::string const& pathname) const {
+    save_checkpoint(pathname, layers_, name_to_index_);
+    std::cout << "Weights saved\n";
+}
+
+void NeuralNet::dump_predictions(std::string const& dumpdir, std::string const& description_path, DatasetView const& datset, ThreadPool& pool) const {
+    auto predictions = predict(datset, pool);
+
+    // Only outputs that belong to a class are described, in output order, so
+    // a last layer wider than the class list is not an error.
+    std::vector<std::pair<std::size_t, std::string>> outputs;
+    for (auto const& [name, index]: name_to_index_) {
+        if (index < predictions.scores.cols()) outputs.emplace_back(index, name);
     }
+    std::sort(outputs.begin(), outputs.end());
 
-    auto description_file = std::ofstream(parentdir + "predictions.txt", std::ios::out | std::ios::trunc);
+    auto description_file = std::ofstream(description_path, std::ios::out | std::ios::trunc);
     if (!description_file.is_open()) {
         std::cerr << "Failed to save predictions description file" << std::endl;
         exit(1);
     }
-    description_file << description_string;
+    description_file << "Predictions for files in this directory\n";
+
+    // Images are written in parallel a chunk at a time; the chunk's
+    // descriptions are then appended in order.
+    constexpr std::size_t chunk_size = 256;
+    auto descriptions = std::vector<std::string>(std::min(chunk_size, datset.size()));
+    for (std::size_t first = 0; first < datset.size(); first += chunk_size) {
+        auto count = std::min(chunk_size, datset.size() - first);
+        pool.parallel_for(count, [&](std::size_t i) {
+            auto index = first + i;
+            auto const& image = datset[index].image;
+            auto path = dumpdir + std::to_string(index) + ".ppm";
+            save_to_pbm(path, image, static_cast<std::size_t>(std::lround(std::sqrt(image.size()))));
+
+            auto& description = descriptions[i];
+            description = "\nFile: " + path + ", Class: " + datset[index].name + '\n';
+            auto const* scores = predictions.scores.row(index);
+            for (auto const& [output, name]: outputs) {
+                description += name + ":" + std::to_string(scores[output]) + "\n";
+            }
+            description += '\n';
+        });
+        for (std::size_t i = 0; i < count; i++) {
+            description_file << descriptions[i];
+        }
+    }
     std::cout << "Predictions saved\n";
 }
 
-void NeuralNet::dump_iterations(std::string const& dumppath, Dataset const& dataset) const {
+void NeuralNet::dump_iterations(std::string const& dumppath, DatasetView const& dataset, ThreadPool& pool) const {
     auto file = std::ofstream(dumppath, std::ios::out | std::ios::trunc);
     if (!file.is_open()) {
         std::cerr << "Coulnd save iteration info!\n";
@@ -357,14 +1260,22 @@ void NeuralNet::dump_iterations(std::string const& dumppath, Dataset const& data
     }
     
     file << "Iteration count: " << iteration_loss_.size() << '\n'
-    << "Total cost: " << calculate_total_cost(dataset) << '\n';
+    << "Total cost: " << calculate_total_cost(dataset, pool) << '\n';
 
     for (std::size_t i = 0; i < iteration_loss_.size(); i++) {
         file << iteration_loss_[i] << ' ';
     }
 }
 
-void NeuralNet::dump_statistics(std::string const& dumpdir, Dataset const& dataset) const {
+void NeuralNet::dump_training_stats(std::string const& dumppath) const {
+    stats_.write_json(dumppath);
+}
+
+TrainingStats const& NeuralNet::get_training_stats() const {
+    return stats_;
+}
+
+void NeuralNet::dump_statistics(std::string const& dumpdir, DatasetView const& dataset, ThreadPool& pool) const {
     auto images_dir = dumpdir + "/images/";
     try {
         std::filesystem::create_directory(dumpdir);
@@ -373,9 +1284,10 @@ void NeuralNet::dump_statistics(std::string const& dumpdir, Dataset const& datas
         std::cerr << "Error creating directory: " << e.what() << std::endl;
     }
 
-    dump_weights(dumpdir + "/weights.txt");
-    dump_iterations(dumpdir + "/iterations.txt", dataset);
-    dump_predictions(images_dir, dumpdir, dataset);
+    dump_weights(dumpdir + "/weights.bin");
+    dump_iterations(dumpdir + "/iterations.txt", dataset, pool);
+    dump_training_stats(dumpdir + "/training_stats.json");
+    dump_predictions(images_dir, dumpdir + "/predictions.txt", dataset, pool);
 }
 
 
@@ -394,8 +1306,13 @@ static std::vector<float> parse_line_values(std::string const& line) {
     return result;
 }
 
-using DoubleVec = std::vector<std::vector<float>>;
-using ConfigPart = std::vector<std::pair<DoubleVec, std::vector<float>>>;
+static Matrix to_matrix(std::vector<std::vector<float>> const& rows) {
+    auto result = Matrix(rows.size(), rows.empty() ? 0 : rows[0].size(), MemoryHint::HugePages);
+    for (std::size_t j = 0; j < rows.size(); j++) {
+        std::copy(rows[j].begin(), rows[j].end(), result.row(j));
+    }
+    return result;
+}
 
 ConfigPart load_weights_and_biases(std::string const& filepath) {
     ConfigPart result;
@@ -422,7 +1339,7 @@ ConfigPart load_weights_and_biases(std::string const& filepath) {
             last_weights.push_back(parse_line_values(line));
         } else if (line.find("Bias") != std::string::npos) {
             last_biases = parse_line_values(line);
-            result.push_back({last_weights, last_biases});
+            result.push_back({to_matrix(last_weights), last_biases});
         }
     }
     return result;
@@ -2,12 +2,20 @@
 #include <cmath>
 #include <vector>
 #include <map>
+#include <memory>
+#include <random>
 #include <string>
 #include <set>
 #include "dataLoader.hpp"
+#include "matrix.hpp"
+#include "checkpoint.hpp"
+#include "convolution.hpp"
+#include "trainingStats.hpp"
 
 using ActivationFunction = float(*)(float);
-using LossFunction = float(*)(std::vector<float> const&, std::vector<float> const&);
+using UpdateRule = kernels::UpdateRule;
+// Loss of one image from its n outputs and targets.
+using LossFunction = float(*)(float const* predictions, float const* valid, std::size_t n);
 
 inline float ReLu(float x) {
     return std::max(0.0f, x);
@@ -17,13 +25,13 @@ inline float ReLu_derivative(float x) {
     return x >= 0 ? 1 : 0;
 }
 
-inline float MSE(std::vector<float> const& predictions, std::vector<float> const& valid) { 
+inline float MSE(float const* predictions, float const* valid, std::size_t n) { 
     float sum = 0;
-    for (unsigned long i = 0; i < predictions.size(); i++) {
+    for (std::size_t i = 0; i < n; i++) {
         auto diff = (predictions[i] - valid[i]);
         sum += diff * diff;
     }
-    sum /= predictions.size();
+    sum /= n;
     return sum;
 }
 
@@ -35,15 +43,71 @@ inline float sigm_derivative(float x) {
     return sigm(x) * (1 - sigm(x));
 }
 
+// Vectorized sigmoid approximation, see kernels::fast_sigmoid for its error.
+inline float fast_sigm(float x) {
+    return kernels::fast_sigmoid(x);
+}
+
+inline float fast_sigm_derivative(float x) {
+    auto value = fast_sigm(x);
+    return value * (1 - value);
+}
+
+// Activation policies: the same functions as the pairs above, but called
+// directly so they inline into the layer loops instead of going through an
+// ActivationFunction pointer per element. `function` and `derivative_function`
+// name the runtime pair a policy stands for. derivative() gets both the
+// pre-activation and the activation cached by the forward pass, so the
+// sigmoids need no second exp.
+struct ReLuActivation {
+    static constexpr ActivationFunction function = ReLu;
+    static constexpr ActivationFunction derivative_function = ReLu_derivative;
+    static float apply(float x) { return x > 0.0f ? x : 0.0f; }
+    static void apply(float* values, std::size_t n) { kernels::relu(values, n); }
+    static float derivative(float sum, float) { return sum >= 0.0f ? 1.0f : 0.0f; }
+};
+
+struct SigmoidActivation {
+    static constexpr ActivationFunction function = sigm;
+    static constexpr ActivationFunction derivative_function = sigm_derivative;
+    static float apply(float x) { return sigm(x); }
+    static void apply(float* values, std::size_t n) {
+        for (std::size_t j = 0; j < n; j++) {
+            values[j] = sigm(values[j]);
+        }
+    }
+    static float derivative(float, float value) { return value * (1.0f - value); }
+};
+
+struct FastSigmoidActivation {
+    static constexpr ActivationFunction function = fast_sigm;
+    static constexpr ActivationFunction derivative_function = fast_sigm_derivative;
+    static float apply(float x) { return kernels::fast_sigmoid(x); }
+    static void apply(float* values, std::size_t n) { kernels::sigmoid(values, n); }
+    static float derivative(float, float value) { return value * (1.0f - value); }
+};
+
+// delta[j] = derivative(sums[j], values[j]) * node[j]
+template<typename Activation>
+inline void activation_delta(float const* sums, float const* values, float const* node, float* delta, std::size_t n) {
+    for (std::size_t j = 0; j < n; j++) {
+        delta[j] = Activation::derivative(sums[j], values[j]) * node[j];
+    }
+}
+
+// Half-format layers may come with only `half_weights` (e.g. from a
+// checkpoint); the fp32 master is then rebuilt when training starts.
 struct WeightConfig {
-    std::vector<std::vector<float>> weights;
+    Matrix weights;
     std::vector<float> biases; 
     ActivationFunction function;
     ActivationFunction derivative;
+    WeightFormat format = WeightFormat::Float32;
+    HalfMatrix half_weights;
+    LayerGeometry geometry = {};
 };
 
-using DoubleVec = std::vector<std::vector<float>>;
-using ConfigPart = std::vector<std::pair<DoubleVec, std::vector<float>>>;
+using ConfigPart = std::vector<std::pair<Matrix, std::vector<float>>>;
 ConfigPart load_weights_and_biases(std::string const& filepath);
 
 
@@ -53,6 +117,10 @@ struct FileConfig {
     LossFunction loss;
 
     static FileConfig from_file(std::string const& filepath) {
+        if (is_checkpoint(filepath)) {
+            return load_checkpoint(filepath);
+        }
+
         FileConfig result;
         static std::vector<ActivationFunction> preconfigured_funcs = {ReLu, ReLu, sigm,};
         static std::vector<ActivationFunction> preconfigured_der = {ReLu_derivative, ReLu_derivative, sigm_derivative};
@@ -67,7 +135,7 @@ struct FileConfig {
         auto loaded = load_weights_and_biases(filepath);
         for (std::size_t i = 0; i < loaded.size(); i++) {
             auto [weights, biases]  = loaded[i];
-            result.layer_data.push_back({weights, biases, preconfigured_funcs[i], preconfigured_der[i]});
+            result.layer_data.push_back({weights, biases, preconfigured_funcs[i], preconfigured_der[i], WeightFormat::Float32, {}});
         }
         result.loss = MSE;
         result.mapping = preconfigured_mapping;
@@ -77,96 +145,305 @@ struct FileConfig {
 
 
 
+// Gradient of one layer for one (slice of a) batch. Kept outside of Layer so
+// every training thread can accumulate into its own copy.
+// For a sparse first-layer step `columns` is set and `weights` holds one row
+// (of out_size) per active input column instead of the dense out x in matrix.
+struct LayerGradient {
+    Matrix weights;
+    std::vector<float> biases;
+    std::vector<std::uint32_t> const* columns = nullptr;
+    Matrix node;
+    Matrix delta;
+};
+
+// A dense layer, or a Conv2D/MaxPool2D layer given by its geometry. Feature
+// maps travel through the network flattened, one image per batch row, so
+// every kind takes and produces plain matrices. A convolution's weights are
+// one row of patch weights per output channel, which the optimizers, the
+// gradient reduction and checkpoints treat like any other weight matrix.
+// Pooling layers have neither weights nor an activation.
 class Layer {
 public:
     Layer(std::size_t in_size, std::size_t out_size, ActivationFunction activation, ActivationFunction derivative);
-    Layer(WeightConfig const& config);
+    Layer(LayerGeometry geometry, ActivationFunction activation, ActivationFunction derivative);
+    Layer(WeightConfig config);
 
-    std::vector<float> forward_pass(std::vector<float> const& previous) const;
-    std::vector<float> sum_inputs(std::vector<float> const& previous) const;
-    std::vector<float> const& get_node_gradient() const;
+    // One image: writes the get_out_size() results into `result`.
+    void forward_pass(float const* previous, float* result) const;
+    void sum_inputs(float const* previous, float* result) const;
+    // Batches; `result` is resized, which reuses its buffer once it is large enough.
+    void forward_pass(Matrix const& previous, Matrix& result) const;
+    void sum_inputs(Matrix const& previous, Matrix& result) const;
+    void forward_pass(ActivePixels const& previous, Matrix& result) const;
+    void sum_inputs(ActivePixels const& previous, Matrix& result) const;
+    // Keeps both the pre-activations and the activations for backprop.
+    void forward_pass(Matrix const& previous, Matrix& sums, Matrix& values) const;
+    void forward_pass(ActivePixels const& previous, Matrix& sums, Matrix& values) const;
 
-    std::vector<std::vector<float>> const& get_weights() const;
+    // The fp32 master; empty for a half-format layer outside of training.
+    Matrix const& get_weights() const;
+    // The master, or the half weights widened to fp32 when there is none.
+    Matrix float_weights() const;
+    HalfMatrix const& get_half_weights() const;
+    WeightFormat get_weight_format() const;
     std::vector<float> const& get_bias_weights() const;
+    std::size_t get_in_size() const;
+    std::size_t get_out_size() const;
+    ActivationFunction get_activation() const;
 
-    void update_gradient(float learning_rate);
-    void calculate_out_layer_grad(
-        std::vector<float> const& output_diff,
-        std::vector<float> const& summed_out,
-        std::vector<float> const& layer2_vals
-    );
-    void calculate_second_layer_grad(
-        std::vector<float> const& layer0_vals,
-        std::vector<float> const& sums,
-        std::vector<float> const& out_wsum,
-        std::vector<std::vector<float>> const& out_weights,
-        std::vector<float> const& out_grad
-    );
+    LayerGeometry const& get_geometry() const;
+    // Bytes of weights and biases as stored for inference.
+    std::size_t memory_size() const;
 
-    void calculate_first_layer_grad(
-        std::vector<float> const& image,
-        std::vector<float> const& layer0_sum,
-        std::vector<float> const& layer1_sum,
-        std::vector<std::vector<float>> const& weights_l1,
-        std::vector<float> const& layer1_grad
-    );
+    // Forward passes read half weights rounded from the fp32 master, which
+    // every update writes first. Convolution weights are tiny and stay fp32.
+    void set_weight_format(WeightFormat format);
+    // Training needs the master; inference of half layers does not.
+    void ensure_master();
+    void release_master();
 
-    void reset_gradient(); 
+    // Allocates the optimizer state kept next to the weights: moments of the
+    // weights and biases, zeroed whenever the rule changes.
+    void set_update_rule(UpdateRule rule);
+
+    LayerGradient make_gradient() const;
+    // Shapes the gradient for the next step (sparse when `columns` is given)
+    // and zeroes what the backward step accumulates into.
+    void reset_gradient(LayerGradient& gradient, ActiveColumns const* columns) const;
+    // One fused pass over the weights, their state and the gradient. Rules
+    // with state sweep whole rows even for a sparse gradient.
+    void update_gradient(LayerGradient const& gradient, kernels::UpdateParams const& params);
+    void update_gradient(
+        LayerGradient const& gradient,
+        kernels::UpdateParams const& params,
+        std::size_t first_row,
+        std::size_t last_row
+    );
+    // Backward step for a layer whose gradient.node already holds
+    // d(loss)/d(output): fills delta and the weight and bias gradients.
+    void calculate_gradient(LayerGradient& gradient, float scale, Matrix const& sums, Matrix const& values, Matrix const& incoming) const;
+    void calculate_gradient(
+        LayerGradient& gradient,
+        float scale,
+        Matrix const& sums,
+        Matrix const& values,
+        ActivePixels const& incoming,
+        ActiveColumns const& columns
+    ) const;
+    // delta = derivative(sums) * gradient.node; `values` are the activations
+    // of `sums`, which the sigmoid derivatives are computed from.
+    void compute_delta(LayerGradient& gradient, Matrix const& sums, Matrix const& values) const;
+    // In-place SGD step: weights -= rate * delta^T * incoming, without a gradient matrix.
+    void apply_delta(LayerGradient const& gradient, float rate, Matrix const& incoming);
+    void apply_delta(LayerGradient const& gradient, float rate, ActivePixels const& incoming);
+    // d(loss)/d(input) of the layer below, from this layer's delta and the
+    // input of the forward pass (which max pooling routes the gradient by).
+    void backpropagate(LayerGradient const& gradient, Matrix const& incoming, Matrix& previous_node) const;
 
 private:
     static constexpr float INIT_MEAN = 0;
     static constexpr float INIT_DEVIATION = 0.123;
 
-    std::vector<std::vector<float>> weights_;
+    Matrix weights_;
+    HalfMatrix half_weights_;
+    WeightFormat format_ = WeightFormat::Float32;
     std::vector<float> biases_;
-    std::vector<std::vector<float>> weight_gradient_;
-    std::vector<float> bias_gradient_;
-    std::vector<float> node_gradient_;
+    UpdateRule update_rule_ = UpdateRule::Sgd;
+    Matrix moment1_;
+    Matrix moment2_;
+    std::vector<float> bias_moment1_;
+    std::vector<float> bias_moment2_;
     
+    LayerGeometry geometry_;
     std::size_t in_size_;
     std::size_t out_size_;
     ActivationFunction activation_;
     ActivationFunction activation_derivative_;
+
+    bool is_half() const { return format_ != WeightFormat::Float32; }
+    std::size_t weight_cols() const;
+    void randomize();
+    void convolve(Matrix const& previous, Matrix& result) const;
+    void pool(Matrix const& previous, Matrix& result) const;
+    // weights += scale * delta (x) patches, biases += scale * delta summed over positions
+    void convolution_gradient(Matrix const& delta, Matrix const& incoming, float scale, Matrix& weights, float* biases) const;
+    void sync_half(std::size_t first_row, std::size_t last_row);
+    void apply_activation(float* values) const;
+    void activate(Matrix const& sums, Matrix& values) const;
+    void accumulate_gradient(LayerGradient& gradient, float scale, Matrix const& incoming) const;
+    void accumulate_gradient(LayerGradient& gradient, float scale, ActivePixels const& incoming, ActiveColumns const& columns) const;
 };
 
+class ThreadPool;
+class BatchStream;
+class CheckpointWriter;
+
 class NeuralNet {
 public:
+    struct Feature {
+        LayerKind kind;             // Conv2D or MaxPool2D
+        std::size_t channels;       // output channels of a Conv2D; pooling keeps its input's
+        std::size_t kernel;         // side of the square window
+        std::size_t stride = 1;
+        std::size_t padding = 0;    // zeros around the input, Conv2D only
+        ActivationFunction function = ReLu;     // Conv2D only
+        ActivationFunction derivative = ReLu_derivative;
+    };
+
     struct Config {
         std::set<std::string> class_names;
         std::vector<std::pair<std::size_t, std::size_t>> layers_sizes;
         std::vector<ActivationFunction> functions;
         std::vector<ActivationFunction> derivatives;
         LossFunction loss_function;
+        WeightFormat weight_format = WeightFormat::Float32;
+        // Convolution and pooling layers in front of the dense ones. They
+        // take the square, single-channel images of layers_sizes[0].first
+        // pixels, and the first dense layer takes whatever the last of them
+        // produces instead.
+        std::vector<Feature> features = {};
+    };
+
+    struct Optimizer {
+        UpdateRule rule = UpdateRule::Sgd;
+        float momentum = 0.9f;      // Momentum and Nesterov
+        float beta1 = 0.9f;         // Adam
+        float beta2 = 0.999f;
+        float epsilon = 1e-8f;
+    };
+
+    struct TrainConfig {
+        std::size_t iterations;
+        float learning_rate;
+        std::size_t batch_size;
+        std::size_t threads;
+        Optimizer optimizer = {};
+        // Background checkpoints, every checkpoint_interval iterations and/or
+        // checkpoint_seconds (0 = never), plus one when training ends.
+        std::string checkpoint_path = {};
+        std::size_t checkpoint_interval = 0;
+        double checkpoint_seconds = 0;
+        // Shuffle the dataset's order at the start of every epoch. An epoch
+        // ends when the next batch would run past the last record; the few
+        // records left over are skipped that time round.
+        bool shuffle = false;
+        unsigned int seed = std::random_device{}();
+    };
+
+    struct Predictions {
+        Matrix scores;                      // output activations, one row per image
+        std::vector<std::size_t> classes;   // best scoring output that has a class name
+    };
+
+    // Pre-activations and activations of every layer from one forward pass.
+    struct ForwardTape {
+        std::vector<Matrix> sums;
+        std::vector<Matrix> values;
+    };
+
+    // Every buffer one thread needs for a forward and backward pass: the
+    // input batch, the tape, the per-layer deltas and gradients and the loss
+    // target. make_workspace allocates them for a batch size up front, so
+    // training steps and predictions only write into them.
+    struct Workspace {
+        Batch batch;
+        ForwardTape tape;
+        std::vector<LayerGradient> gradients;
+        std::vector<float> target;      // one-hot row handed to the loss function
+        float loss = 0.0f;
     };
 
     NeuralNet(Config const& config);
-    NeuralNet(FileConfig const& config);
-    
-    std::vector<float> forward_pass(std::vector<float> const& image) const;
-    void learn(Dataset const& dataset, std::size_t L, float learning_rate);
-    float calculate_total_cost(Dataset const& test) const;
+    NeuralNet(FileConfig config);
 
-    void dump_statistics(std::string const& dumpdir, Dataset const& datset) const;
+    // With `weight_gradients` also the full weight gradient of every layer,
+    // which only multi-threaded steps and optimizers with state fill.
+    Workspace make_workspace(std::size_t batch_size, bool weight_gradients = false) const;
+    // One image: writes the network's outputs into `scores`.
+    void forward_pass(float const* image, float* scores, Workspace& workspace) const;
+    // Inference in the workspace's buffers; returns its output activations.
+    Matrix const& forward_pass(Batch const& batch, Workspace& workspace) const;
+    Matrix forward_pass(Matrix const& images) const;
+    Matrix forward_pass(Batch const& batch) const;
+    // Classifies every record in batches of `batch_size`, one batch per pool task.
+    Predictions predict(DatasetView const& records, ThreadPool& pool, std::size_t batch_size = 256) const;
+    void learn(DatasetView const& dataset, TrainConfig const& config);
+    // Trains on batches as the stream delivers them; stops early when a
+    // non-repeating stream runs out.
+    void learn(BatchStream& stream, TrainConfig const& config);
+    float calculate_total_cost(DatasetView const& test, ThreadPool& pool) const;
+
+    // Writes weights.bin, iterations.txt, training_stats.json and the predictions.
+    void dump_statistics(std::string const& dumpdir, DatasetView const& datset, ThreadPool& pool) const;
+    // Timings and counters of the last learn() call.
+    TrainingStats const& get_training_stats() const;
 
     std::string get_result_name(std::size_t index) const;
     std::size_t get_result_index(std::string const& name) const;
+    bool has_class(std::string const& name) const;
+    std::vector<Layer> const& get_layers() const;
+    std::map<std::string, std::size_t> const& get_mapping() const;
 
 private:
     LossFunction loss_function_;
     std::vector<Layer> layers_;
     std::map<std::string, std::size_t> name_to_index_;
     std::vector<float> iteration_loss_;
+    TrainingStats stats_;
+    UpdateRule update_rule_ = UpdateRule::Sgd;
+    std::size_t optimizer_steps_ = 0;
 
-    float calculate_cost(Record const& record) const;
-    void calculate_gradients();
-    void update_weigths(float lr, Record const& record);
-    void reset_gradients();
-    std::vector<float> get_output_differences(
-        std::vector<float> const& predictions,
-        std::string const& record_name
+    void add_features(Config const& config);
+    // One workspace per thread, each sized for its slice of a batch.
+    std::vector<Workspace> make_workspaces(ThreadPool const& pool, std::size_t batch_size) const;
+    void train_step(
+        ThreadPool& pool,
+        std::vector<Workspace>& workspaces,
+        ActiveColumns& columns,
+        DatasetView const& dataset,
+        std::size_t first,
+        std::size_t batch_size,
+        TrainConfig const& config
+    );
+    void prepare_optimizer(Optimizer const& optimizer);
+    std::unique_ptr<CheckpointWriter> make_checkpoint_writer(TrainConfig const& config) const;
+    // Hands a snapshot to the writer when an interval has passed since `last`.
+    void checkpoint_if_due(
+        CheckpointWriter* writer,
+        TrainConfig const& config,
+        std::size_t iteration,
+        TrainingStats::Clock::time_point& last
+    );
+    // Constants of the next update; Adam's bias correction goes into the rate.
+    kernels::UpdateParams next_update(Optimizer const& optimizer, float learning_rate);
+    void record_forward(Batch const& batch, ForwardTape& tape) const;
+    float tape_loss(Workspace& workspace) const;
+    float fused_step(
+        Workspace& workspace,
+        ActiveColumns const& columns,
+        kernels::UpdateParams const& params,
+        float scale
+    );
+    void reset_gradients(std::vector<LayerGradient>& gradients, ActiveColumns const* columns) const;
+    // Fills `gradients` from a tape recorded by record_forward.
+    void calculate_gradients(
+        Batch const& batch,
+        ActiveColumns const& columns,
+        ForwardTape const& tape,
+        std::vector<LayerGradient>& gradients,
+        float scale
+    ) const;
+    void reduce_gradients(ThreadPool& pool, std::vector<Workspace>& workspaces, std::size_t active) const;
+    void update_weigths(ThreadPool& pool, kernels::UpdateParams const& params, std::vector<LayerGradient> const& gradients);
+    void output_gradient(
+        Matrix const& predictions,
+        std::vector<std::string> const& record_names,
+        Matrix& node
     ) const;
 
     void dump_weights(std::string const& pathname) const;
-    void dump_predictions(std::string const& dumpdir,std::string const& parentdir, Dataset const& datset) const;
-    void dump_iterations(std::string const& dumppath, Dataset const& datset) const;
+    void dump_predictions(std::string const& dumpdir, std::string const& description_path, DatasetView const& datset, ThreadPool& pool) const;
+    void dump_iterations(std::string const& dumppath, DatasetView const& datset, ThreadPool& pool) const;
+    void dump_training_stats(std::string const& dumppath) const;
 };
@@ -0,0 +1,91 @@
+#include "packedImage.hpp"
+#include <algorithm>
+#include <cmath>
+
+PackedImage::PackedImage(PixelFormat format, std::size_t size):
+    format_(format),
+    size_(size),
+    words_(word_count(format, size), 0) {
+}
+
+PackedImage::PackedImage(PixelFormat format, std::size_t size, std::uint64_t const* words):
+    format_(format),
+    size_(size),
+    words_(words, words + word_count(format, size)) {
+}
+
+std::size_t PackedImage::word_count(PixelFormat format, std::size_t size) {
+    std::size_t per_word = format == PixelFormat::Bit ? 64 : 8;
+    return (size + per_word - 1) / per_word;
+}
+
+PackedImage PackedImage::from_floats(float const* pixels, std::size_t size) {
+    bool binary = std::all_of(pixels, pixels + size, [](float v){ return v == 0.0f || v == 1.0f; });
+    auto result = PackedImage(binary ? PixelFormat::Bit : PixelFormat::Byte, size);
+    for (std::size_t i = 0; i < size; i++) {
+        if (pixels[i] != 0.0f) result.set(i, pixels[i]);
+    }
+    return result;
+}
+
+PackedImage PackedImage::from_floats(std::vector<float> const& pixels) {
+    return from_floats(pixels.data(), pixels.size());
+}
+
+float PackedImage::operator[](std::size_t i) const {
+    if (format_ == PixelFormat::Bit) {
+        return (words_[i / 64] >> (i % 64)) & 1 ? 1.0f : 0.0f;
+    }
+    return ((words_[i / 8] >> (8 * (i % 8))) & 0xFF) / 255.0f;
+}
+
+void PackedImage::set(std::size_t i, float value) {
+    if (format_ == PixelFormat::Bit) {
+        auto mask = std::uint64_t{1} << (i % 64);
+        words_[i / 64] = value != 0.0f ? words_[i / 64] | mask : words_[i / 64] & ~mask;
+        return;
+    }
+    auto byte = static_cast<std::uint64_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * 255.0f));
+    auto shift = 8 * (i % 8);
+    words_[i / 8] = (words_[i / 8] & ~(std::uint64_t{0xFF} << shift)) | (byte << shift);
+}
+
+void PackedImage::unpack(float* out) const {
+    if (format_ == PixelFormat::Bit) {
+        for (std::size_t w = 0; w < words_.size(); w++) {
+            auto word = words_[w];
+            auto count = std::min<std::size_t>(64, size_ - w * 64);
+            for (std::size_t b = 0; b < count; b++) {
+                out[w * 64 + b] = static_cast<float>((word >> b) & 1);
+            }
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < size_; i++) {
+        out[i] = (*this)[i];
+    }
+}
+
+std::vector<float> PackedImage::to_floats() const {
+    auto result = std::vector<float>(size_);
+    unpack(result.data());
+    return result;
+}
+
+void PackedImage::append_active(std::vector<std::uint32_t>& indices) const {
+    for (std::size_t w = 0; w < words_.size(); w++) {
+        for (auto word = words_[w]; word != 0; word &= word - 1) {
+            indices.push_back(static_cast<std::uint32_t>(w * 64 + __builtin_ctzll(word)));
+        }
+    }
+}
+
+void ActivePixels::clear() {
+    indices.clear();
+    offsets.assign(1, 0);
+}
+
+void ActivePixels::add(PackedImage const& image) {
+    image.append_active(indices);
+    offsets.push_back(indices.size());
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class PixelFormat : std::uint32_t {
+    Bit = 1,    // binary pixels, 64 per word
+    Byte = 8,   // intensities 0..255 mapped to [0, 1], 8 per word
+};
+
+// Compact image storage; pixels are expanded to floats only when an image is
+// copied into a batch or handed to the network.
+class PackedImage {
+public:
+    PackedImage() = default;
+    PackedImage(PixelFormat format, std::size_t size);
+    PackedImage(PixelFormat format, std::size_t size, std::uint64_t const* words);
+
+    static PackedImage from_floats(float const* pixels, std::size_t size);
+    static PackedImage from_floats(std::vector<float> const& pixels);
+    static std::size_t word_count(PixelFormat format, std::size_t size);
+
+    std::size_t size() const { return size_; }
+    PixelFormat format() const { return format_; }
+    std::uint64_t const* words() const { return words_.data(); }
+    std::size_t word_count() const { return words_.size(); }
+
+    float operator[](std::size_t i) const;
+    void set(std::size_t i, float value);
+    void unpack(float* out) const;
+    std::vector<float> to_floats() const;
+    // Appends the indices of all set pixels of a binary image.
+    void append_active(std::vector<std::uint32_t>& indices) const;
+
+private:
+    PixelFormat format_ = PixelFormat::Bit;
+    std::size_t size_ = 0;
+    std::vector<std::uint64_t> words_;
+};
+
+// Non-zero pixel indices of binary images, one CSR row per image. Lets the
+// first layer sum only the weights of pixels that are actually set.
+struct ActivePixels {
+    std::vector<std::uint32_t> indices;
+    std::vector<std::size_t> offsets = {0};
+
+    std::size_t rows() const { return offsets.size() - 1; }
+    std::uint32_t const* row(std::size_t b) const { return indices.data() + offsets[b]; }
+    std::size_t row_size(std::size_t b) const { return offsets[b + 1] - offsets[b]; }
+    void clear();
+    void add(PackedImage const& image);
+};
+
+// Union of the active pixels of a batch. A sparse first-layer gradient keeps
+// one row per entry of `columns`; `position` maps a pixel to that row or -1.
+struct ActiveColumns {
+    std::vector<std::uint32_t> columns;
+    std::vector<std::int32_t> position;
+    std::vector<std::uint64_t> used;    // scratch bitmap, kept between batches
+};
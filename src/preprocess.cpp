@@ -0,0 +1,129 @@
+#include "preprocess.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+static std::size_t image_side(std::size_t size) {
+    auto side = static_cast<std::size_t>(std::lround(std::sqrt(static_cast<double>(size))));
+    if (side * side != size) {
+        std::cerr << "Preprocessing needs square images, got " << size << " pixels\n";
+        exit(1);
+    }
+    return side;
+}
+
+static std::size_t side_after_crop(Preprocessing const& config, std::size_t side) {
+    if (config.crop > side) {
+        std::cerr << "Crop of " << config.crop << " does not fit a " << side << " pixel image\n";
+        exit(1);
+    }
+    return config.crop == 0 ? side : config.crop;
+}
+
+static std::size_t side_after_pooling(Preprocessing const& config, std::size_t side) {
+    if (config.pool == PoolMode::None || config.pooled_side == 0) return side;
+    if (config.pooled_side > side || side % config.pooled_side != 0) {
+        std::cerr << "Cannot pool a " << side << " pixel image to " << config.pooled_side << '\n';
+        exit(1);
+    }
+    return config.pooled_side;
+}
+
+static std::vector<float> center_crop(std::vector<float> const& pixels, std::size_t side, std::size_t crop) {
+    auto offset = (side - crop) / 2;
+    std::vector<float> result(crop * crop);
+    for (std::size_t y = 0; y < crop; y++) {
+        auto const* row = pixels.data() + (y + offset) * side + offset;
+        std::copy(row, row + crop, result.data() + y * crop);
+    }
+    return result;
+}
+
+// Samples the smallest square around the set pixels back onto the full side
+// (nearest neighbour). Blank images are left alone.
+static void fill_bounding_box(std::vector<float>& pixels, std::size_t side) {
+    std::size_t min_x = side, min_y = side, max_x = 0, max_y = 0;
+    for (std::size_t y = 0; y < side; y++) {
+        for (std::size_t x = 0; x < side; x++) {
+            if (pixels[y * side + x] == 0.0f) continue;
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+        }
+    }
+    if (min_x > max_x) return;
+
+    auto box = std::max(max_x - min_x, max_y - min_y) + 1;
+    // Centre the square on the box; it may reach past the edges, which read as blank.
+    auto left = static_cast<long>(min_x + max_x + 1 - box) / 2;
+    auto top = static_cast<long>(min_y + max_y + 1 - box) / 2;
+    auto source = pixels;
+    auto limit = static_cast<long>(side);
+    std::vector<long> columns(side);
+    for (std::size_t x = 0; x < side; x++) {
+        columns[x] = left + static_cast<long>(x * box / side);
+    }
+    for (std::size_t y = 0; y < side; y++) {
+        auto sy = top + static_cast<long>(y * box / side);
+        auto* row = pixels.data() + y * side;
+        if (sy < 0 || sy >= limit) {
+            std::fill(row, row + side, 0.0f);
+            continue;
+        }
+        auto const* source_row = source.data() + sy * side;
+        for (std::size_t x = 0; x < side; x++) {
+            auto sx = columns[x];
+            row[x] = sx >= 0 && sx < limit ? source_row[sx] : 0.0f;
+        }
+    }
+}
+
+static std::vector<float> pool_pixels(std::vector<float> const& pixels, std::size_t side, PoolMode mode, std::size_t pooled) {
+    auto factor = side / pooled;
+    std::vector<float> result(pooled * pooled);
+    for (std::size_t y = 0; y < pooled; y++) {
+        for (std::size_t x = 0; x < pooled; x++) {
+            float value = 0.0f;
+            for (std::size_t dy = 0; dy < factor; dy++) {
+                auto const* row = pixels.data() + (y * factor + dy) * side + x * factor;
+                for (std::size_t dx = 0; dx < factor; dx++) {
+                    value = mode == PoolMode::Max ? std::max(value, row[dx]) : value + row[dx];
+                }
+            }
+            result[y * pooled + x] = mode == PoolMode::Max ? value : value / (factor * factor);
+        }
+    }
+    return result;
+}
+
+bool Preprocessing::enabled() const {
+    return crop != 0 || bounding_box || (pool != PoolMode::None && pooled_side != 0);
+}
+
+std::size_t Preprocessing::output_size(std::size_t input_size) const {
+    if (!enabled()) return input_size;
+    auto side = side_after_pooling(*this, side_after_crop(*this, image_side(input_size)));
+    return side * side;
+}
+
+PackedImage Preprocessing::apply(PackedImage const& image) const {
+    if (!enabled()) return image;
+    auto side = image_side(image.size());
+    auto pixels = image.to_floats();
+
+    auto cropped = side_after_crop(*this, side);
+    if (cropped != side) {
+        pixels = center_crop(pixels, side, cropped);
+        side = cropped;
+    }
+    if (bounding_box) {
+        fill_bounding_box(pixels, side);
+    }
+    auto pooled = side_after_pooling(*this, side);
+    if (pooled != side) {
+        pixels = pool_pixels(pixels, side, pool, pooled);
+    }
+    return PackedImage::from_floats(pixels);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include "packedImage.hpp"
+
+enum class PoolMode {
+    None,
+    Max,        // a binary image stays binary
+    Average,    // binary images become Byte intensities
+};
+
+// Image transformations applied once, as records are loaded, in this order:
+// center crop, bounding-box normalization, pooling. Images are square; sizes
+// are side lengths in pixels.
+struct Preprocessing {
+    std::size_t crop = 0;           // side of the centered square kept, 0 = all of it
+    bool bounding_box = false;      // scale the drawing's bounding box up to fill the image
+    PoolMode pool = PoolMode::None;
+    std::size_t pooled_side = 0;    // side after pooling, must divide the side before it
+
+    bool enabled() const;
+    // Pixel count of the images produced from `input_size` pixel images.
+    std::size_t output_size(std::size_t input_size) const;
+    PackedImage apply(PackedImage const& image) const;
+};
@@ -0,0 +1,225 @@
+#include "quantized.hpp"
+#include "kernels.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+static constexpr float QUANT_MAX = 127.0f;
+static constexpr std::size_t ROW_ALIGNMENT = 64;
+// Images per block in the layer loop, so one pass over a weight row serves
+// several inputs while their rows stay in cache.
+static constexpr std::size_t IMAGE_BLOCK = 8;
+
+static std::size_t padded(std::size_t size) {
+    return (size + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+}
+
+void QuantizedBatch::reset(std::size_t row_count, std::size_t col_count) {
+    rows = row_count;
+    cols = col_count;
+    stride = padded(col_count);
+    values.assign(rows * stride, 0);
+    scales.assign(rows, 0.0f);
+}
+
+void QuantizedBatch::quantize(Matrix const& source) {
+    reset(source.rows(), source.cols());
+    for (std::size_t b = 0; b < rows; b++) {
+        auto const* input = source.row(b);
+        auto max = *std::max_element(input, input + cols);
+        if (max <= 0.0f) continue;
+        scales[b] = max / QUANT_MAX;
+        auto inverse = QUANT_MAX / max;
+        auto* output = values.data() + b * stride;
+        for (std::size_t i = 0; i < cols; i++) {
+            output[i] = static_cast<std::uint8_t>(std::lround(std::max(input[i], 0.0f) * inverse));
+        }
+    }
+}
+
+void QuantizedBatch::quantize(DatasetView const& records, std::size_t first, std::size_t count) {
+    reset(count, records[first].image.size());
+    std::vector<float> pixels;
+    for (std::size_t b = 0; b < count; b++) {
+        auto const& image = records[first + b].image;
+        auto* output = values.data() + b * stride;
+        if (image.format() == PixelFormat::Bit) {
+            // Binary pixels are exact: 1 -> 127 with scale 1/127.
+            scales[b] = 1.0f / QUANT_MAX;
+            for (std::size_t w = 0; w < image.word_count(); w++) {
+                for (auto word = image.words()[w]; word != 0; word &= word - 1) {
+                    output[w * 64 + __builtin_ctzll(word)] = static_cast<std::uint8_t>(QUANT_MAX);
+                }
+            }
+            continue;
+        }
+        pixels.resize(cols);
+        image.unpack(pixels.data());
+        auto max = *std::max_element(pixels.begin(), pixels.end());
+        if (max <= 0.0f) continue;
+        scales[b] = max / QUANT_MAX;
+        for (std::size_t i = 0; i < cols; i++) {
+            output[i] = static_cast<std::uint8_t>(std::lround(pixels[i] * QUANT_MAX / max));
+        }
+    }
+}
+
+QuantizedLayer::QuantizedLayer(Layer const& layer, bool column_major):
+    biases_(layer.get_bias_weights()),
+    in_size_(layer.get_in_size()),
+    out_size_(layer.get_out_size()),
+    stride_(padded(column_major ? out_size_ : in_size_)),
+    column_major_(column_major),
+    activation_(layer.get_activation()) {
+
+    auto weights = layer.float_weights();
+    weights_.assign((column_major_ ? in_size_ : out_size_) * stride_, 0);
+    scales_.assign(out_size_, 0.0f);
+    for (std::size_t j = 0; j < out_size_; j++) {
+        auto const* row = weights.row(j);
+        float max = 0.0f;
+        for (std::size_t i = 0; i < in_size_; i++) {
+            max = std::max(max, std::abs(row[i]));
+        }
+        if (max == 0.0f) continue;
+        scales_[j] = max / QUANT_MAX;
+        for (std::size_t i = 0; i < in_size_; i++) {
+            auto index = column_major_ ? i * stride_ + j : j * stride_ + i;
+            weights_[index] = static_cast<std::int8_t>(std::lround(row[i] * QUANT_MAX / max));
+        }
+    }
+}
+
+void QuantizedLayer::forward_pass(QuantizedBatch const& input, Matrix& result) const {
+    result.resize(input.rows, out_size_);
+    if (column_major_) {
+        sum_columns(input, result);
+    } else {
+        sum_rows(input, result);
+    }
+
+    for (std::size_t b = 0; b < result.rows(); b++) {
+        auto* row = result.row(b);
+        if (activation_ == ReLu) {
+            kernels::relu(row, out_size_);
+            continue;
+        }
+        if (activation_ == fast_sigm) {
+            kernels::sigmoid(row, out_size_);
+            continue;
+        }
+        for (std::size_t j = 0; j < out_size_; j++) {
+            row[j] = activation_(row[j]);
+        }
+    }
+}
+
+void QuantizedLayer::sum_rows(QuantizedBatch const& input, Matrix& result) const {
+    for (std::size_t bb = 0; bb < input.rows; bb += IMAGE_BLOCK) {
+        auto b_end = std::min(bb + IMAGE_BLOCK, input.rows);
+        for (std::size_t j = 0; j < out_size_; j++) {
+            auto const* weights = weights_.data() + j * stride_;
+            for (std::size_t b = bb; b < b_end; b++) {
+                auto sum = kernels::dot_u8s8(input.row(b), weights, in_size_);
+                result(b, j) = static_cast<float>(sum) * input.scales[b] * scales_[j] + biases_[j];
+            }
+        }
+    }
+}
+
+void QuantizedLayer::sum_columns(QuantizedBatch const& input, Matrix& result) const {
+    std::vector<std::int32_t> sums(out_size_);
+    for (std::size_t b = 0; b < input.rows; b++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        auto const* values = input.row(b);
+        // Rows are zero padded to 64 bytes, so whole words can be tested.
+        for (std::size_t i = 0; i < in_size_; i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, values + i, sizeof(word));
+            if (word == 0) continue;
+            for (auto k = i; k < std::min(i + 8, in_size_); k++) {
+                if (values[k] == 0) continue;
+                kernels::axpy_s8(values[k], weights_.data() + k * stride_, sums.data(), out_size_);
+            }
+        }
+        for (std::size_t j = 0; j < out_size_; j++) {
+            result(b, j) = static_cast<float>(sums[j]) * input.scales[b] * scales_[j] + biases_[j];
+        }
+    }
+}
+
+std::size_t QuantizedLayer::memory_size() const {
+    return weights_.size() + (scales_.size() + biases_.size()) * sizeof(float);
+}
+
+QuantizedNet::QuantizedNet(NeuralNet const& net) {
+    auto const& layers = net.get_layers();
+    for (std::size_t l = 0; l < layers.size(); l++) {
+        if (!layers[l].get_geometry().is_dense()) {
+            std::cerr << "Cannot quantize layer " << l << ": only dense layers have an int8 version\n";
+            exit(1);
+        }
+        auto activation = layers[l].get_activation();
+        if (l + 1 < layers.size() && activation != ReLu && activation != sigm && activation != fast_sigm) {
+            std::cerr << "Cannot quantize layer " << l << ": its activations may be negative\n";
+            exit(1);
+        }
+        layers_.emplace_back(layers[l], l == 0);
+    }
+
+    auto outputs = layers.back().get_out_size();
+    for (auto const& [name, index]: net.get_mapping()) {
+        if (index < outputs) named_outputs_.push_back(index);
+    }
+}
+
+bool QuantizedNet::supports(NeuralNet const& net) {
+    auto const& layers = net.get_layers();
+    return std::all_of(layers.begin(), layers.end(), [](Layer const& layer) { return layer.get_geometry().is_dense(); });
+}
+
+Matrix QuantizedNet::forward_pass(DatasetView const& records, std::size_t first, std::size_t count) const {
+    QuantizedBatch input;
+    Matrix values;
+    input.quantize(records, first, count);
+    for (std::size_t l = 0; l < layers_.size(); l++) {
+        if (l > 0) input.quantize(values);
+        layers_[l].forward_pass(input, values);
+    }
+    return values;
+}
+
+NeuralNet::Predictions QuantizedNet::predict(DatasetView const& records, ThreadPool& pool, std::size_t batch_size) const {
+    auto count = records.size();
+    auto batches = batch_count(count, batch_size);
+    NeuralNet::Predictions result;
+    if (count == 0) return result;
+    std::vector<Matrix> scores(batches);
+    pool.parallel_for(batches, [&](std::size_t task) {
+        auto first = task * batch_size;
+        scores[task] = forward_pass(records, first, std::min(batch_size, count - first));
+    });
+
+    result.scores.resize(count, scores[0].cols());
+    result.classes.resize(count);
+    for (std::size_t b = 0; b < count; b++) {
+        auto const* row = scores[b / batch_size].row(b % batch_size);
+        std::copy(row, row + result.scores.cols(), result.scores.row(b));
+        auto best = named_outputs_.empty() ? 0 : named_outputs_[0];
+        for (auto index: named_outputs_) {
+            if (row[index] > row[best]) best = index;
+        }
+        result.classes[b] = best;
+    }
+    return result;
+}
+
+std::size_t QuantizedNet::memory_size() const {
+    std::size_t total = 0;
+    for (auto const& layer: layers_) {
+        total += layer.memory_size();
+    }
+    return total;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "nn.hpp"
+
+class ThreadPool;
+
+// Activations of a batch quantized per image to 7 bits, x ~ scales[b] * value
+// with value in [0, 127], which is what the u8 x s8 dot kernels expect.
+// Rows are padded to 64 bytes.
+struct QuantizedBatch {
+    std::vector<std::uint8_t> values;
+    std::vector<float> scales;
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    std::size_t stride = 0;
+
+    void quantize(Matrix const& source);
+    // Records [first, first + count) of `records`.
+    void quantize(DatasetView const& records, std::size_t first, std::size_t count);
+    std::uint8_t const* row(std::size_t b) const { return values.data() + b * stride; }
+
+private:
+    void reset(std::size_t rows, std::size_t cols);
+};
+
+// Int8 copy of a trained layer. Each output row is mapped symmetrically onto
+// [-127, 127], w[j][i] ~ scales[j] * weights[j][i]; biases stay fp32.
+// Hidden layers keep rows contiguous and use the u8 x s8 dot kernel. The
+// first layer sees mostly blank images, so it is stored column-major and
+// only the columns of non-zero pixels are accumulated.
+class QuantizedLayer {
+public:
+    QuantizedLayer(Layer const& layer, bool column_major);
+
+    void forward_pass(QuantizedBatch const& input, Matrix& result) const;
+    std::size_t memory_size() const;
+
+private:
+    std::vector<std::int8_t> weights_;
+    std::vector<float> scales_;
+    std::vector<float> biases_;
+    std::size_t in_size_;
+    std::size_t out_size_;
+    std::size_t stride_;
+    bool column_major_;
+    ActivationFunction activation_;
+
+    void sum_rows(QuantizedBatch const& input, Matrix& result) const;
+    void sum_columns(QuantizedBatch const& input, Matrix& result) const;
+};
+
+// Inference-only int8 version of a trained network (post-training, no
+// calibration data needed). Hidden activations must be non-negative, which
+// holds for ReLu and the sigmoids.
+class QuantizedNet {
+public:
+    explicit QuantizedNet(NeuralNet const& net);
+    // False for networks with convolution or pooling layers.
+    static bool supports(NeuralNet const& net);
+
+    Matrix forward_pass(DatasetView const& records, std::size_t first, std::size_t count) const;
+    NeuralNet::Predictions predict(DatasetView const& records, ThreadPool& pool, std::size_t batch_size = 256) const;
+    std::size_t memory_size() const;
+
+private:
+    std::vector<QuantizedLayer> layers_;
+    std::vector<std::size_t> named_outputs_;
+};
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "nn.hpp"
+#include "threadPool.hpp"
+
+// Column-major inference copy of a trained dense Layer. Weights are kept as
+// fp32 whatever the source format, stored in x out: a binary image then adds
+// up one contiguous column per set pixel instead of gathering from every
+// output row, which is where the speed-up over Layer comes from. The
+// activation is a policy (see ReLuActivation) chosen at compile time and
+// applied to each output row after the product and bias; the products
+// themselves go through the dispatched kernels. In and Out pin the layer's
+// shape at compile time; DYNAMIC_EXTENT takes it from the trained layer.
+constexpr std::size_t DYNAMIC_EXTENT = static_cast<std::size_t>(-1);
+
+template<typename Activation, std::size_t In = DYNAMIC_EXTENT, std::size_t Out = DYNAMIC_EXTENT>
+class StaticLayer {
+public:
+    static_assert(In != 0 && Out != 0, "a layer needs inputs and outputs");
+    static constexpr std::size_t IN_EXTENT = In;
+    static constexpr std::size_t OUT_EXTENT = Out;
+
+    static bool matches(Layer const& layer) {
+        return layer.get_geometry().is_dense() && layer.get_activation() == Activation::function
+            && (In == DYNAMIC_EXTENT || layer.get_in_size() == In)
+            && (Out == DYNAMIC_EXTENT || layer.get_out_size() == Out);
+    }
+
+    explicit StaticLayer(Layer const& layer):
+        columns_(layer.get_in_size(), layer.get_out_size(), MemoryHint::HugePages),
+        biases_(layer.get_bias_weights()),
+        in_size_(layer.get_in_size()),
+        out_size_(layer.get_out_size()) {
+        if (!matches(layer)) {
+            std::cerr << "Layer " << in_size_ << "x" << out_size_ << " does not match its specialization\n";
+            exit(1);
+        }
+        transpose(layer);
+    }
+
+    std::size_t in_size() const {
+        if constexpr (In != DYNAMIC_EXTENT) return In;
+        else return in_size_;
+    }
+    std::size_t out_size() const {
+        if constexpr (Out != DYNAMIC_EXTENT) return Out;
+        else return out_size_;
+    }
+
+    void forward_pass(Matrix const& previous, Matrix& result) const {
+        result.resize(previous.rows(), out_size());
+        gemm_nn(previous, columns_, result);
+        for (std::size_t b = 0; b < result.rows(); b++) {
+            auto* row = result.row(b);
+            for (std::size_t j = 0; j < out_size(); j++) {
+                row[j] += biases_[j];
+            }
+            Activation::apply(row, out_size());
+        }
+    }
+
+    // Binary images given by their active pixels.
+    void forward_pass(ActivePixels const& previous, Matrix& result) const {
+        result.resize(previous.rows(), out_size());
+        for (std::size_t b = 0; b < previous.rows(); b++) {
+            auto* row = result.row(b);
+            std::copy(biases_.begin(), biases_.end(), row);
+            kernels::sum_rows(columns_.data(), columns_.stride(), previous.row(b), previous.row_size(b), row, out_size());
+            Activation::apply(row, out_size());
+        }
+    }
+
+private:
+    static constexpr std::size_t TRANSPOSE_BLOCK = 64;
+
+    Matrix columns_;
+    std::vector<float> biases_;
+    std::size_t in_size_;
+    std::size_t out_size_;
+
+    // Blocked, so neither side walks a long column with a power-of-two stride.
+    void transpose(Layer const& layer) {
+        auto widened = layer.get_weights().empty() ? layer.float_weights() : Matrix();
+        auto const& weights = widened.empty() ? layer.get_weights() : widened;
+        for (std::size_t jb = 0; jb < out_size_; jb += TRANSPOSE_BLOCK) {
+            auto j_end = std::min(jb + TRANSPOSE_BLOCK, out_size_);
+            for (std::size_t ib = 0; ib < in_size_; ib += TRANSPOSE_BLOCK) {
+                auto i_end = std::min(ib + TRANSPOSE_BLOCK, in_size_);
+                for (std::size_t j = jb; j < j_end; j++) {
+                    for (std::size_t i = ib; i < i_end; i++) {
+                        columns_(i, j) = weights(j, i);
+                    }
+                }
+            }
+        }
+    }
+};
+
+// True when each fixed output extent equals the next layer's fixed input extent.
+template<typename First, typename... Rest>
+constexpr bool extents_chain() {
+    if constexpr (sizeof...(Rest) == 0) {
+        return true;
+    } else {
+        using Next = std::tuple_element_t<0, std::tuple<Rest...>>;
+        return (First::OUT_EXTENT == DYNAMIC_EXTENT || Next::IN_EXTENT == DYNAMIC_EXTENT || First::OUT_EXTENT == Next::IN_EXTENT)
+            && extents_chain<Rest...>();
+    }
+}
+
+// Inference-only network of StaticLayers, built from a trained NeuralNet with
+// the same number of dense layers, the same activations and any shapes the
+// layers fix. Layers are held in a tuple, so the layer sequence is resolved
+// at compile time.
+template<typename... Layers>
+class StaticNet {
+public:
+    static_assert(sizeof...(Layers) > 0, "a network needs at least one layer");
+    static_assert(extents_chain<Layers...>(), "adjacent layers disagree on the size between them");
+
+    // True when `net` has this many dense layers with matching activations
+    // and, where the layers fix them, matching shapes.
+    static bool matches(NeuralNet const& net) {
+        auto const& layers = net.get_layers();
+        return layers.size() == sizeof...(Layers) && matches(layers, std::index_sequence_for<Layers...>{});
+    }
+
+    explicit StaticNet(NeuralNet const& net): StaticNet(net, std::index_sequence_for<Layers...>{}) {}
+
+    Matrix forward_pass(DatasetView const& records, std::size_t first, std::size_t count) const {
+        Batch batch;
+        fill_batch(batch, records, first, count, is_sparse_batch(records, first, count));
+        Matrix values, next;
+        if (batch.sparse) {
+            std::get<0>(layers_).forward_pass(batch.active, values);
+        } else {
+            std::get<0>(layers_).forward_pass(batch.images, values);
+        }
+        forward_from<1>(values, next);
+        return values;
+    }
+
+    // Same contract as NeuralNet::predict.
+    NeuralNet::Predictions predict(DatasetView const& records, ThreadPool& pool, std::size_t batch_size = 256) const {
+        auto count = records.size();
+        auto batches = batch_count(count, batch_size);
+        NeuralNet::Predictions result;
+        result.scores.resize(count, std::get<sizeof...(Layers) - 1>(layers_).out_size());
+        result.classes.resize(count);
+        if (count == 0) return result;
+
+        pool.parallel_for(batches, [&](std::size_t task) {
+            auto first = task * batch_size;
+            auto size = std::min(batch_size, count - first);
+            auto scores = forward_pass(records, first, size);
+            for (std::size_t b = 0; b < size; b++) {
+                auto const* row = scores.row(b);
+                std::copy(row, row + scores.cols(), result.scores.row(first + b));
+                auto best = named_outputs_.empty() ? 0 : named_outputs_[0];
+                for (auto index: named_outputs_) {
+                    if (row[index] > row[best]) best = index;
+                }
+                result.classes[first + b] = best;
+            }
+        });
+        return result;
+    }
+
+private:
+    std::tuple<Layers...> layers_;
+    std::vector<std::size_t> named_outputs_;
+
+    template<std::size_t... I>
+    static bool matches(std::vector<Layer> const& layers, std::index_sequence<I...>) {
+        return (Layers::matches(layers[I]) && ...);
+    }
+
+    static std::vector<Layer> const& checked_layers(NeuralNet const& net) {
+        if (!matches(net)) {
+            std::cerr << "Network topology does not match its specialization\n";
+            exit(1);
+        }
+        return net.get_layers();
+    }
+
+    template<std::size_t... I>
+    StaticNet(NeuralNet const& net, std::index_sequence<I...>):
+        layers_(Layers(checked_layers(net)[I])...) {
+        auto outputs = std::get<sizeof...(Layers) - 1>(layers_).out_size();
+        for (auto const& [name, index]: net.get_mapping()) {
+            if (index < outputs) named_outputs_.push_back(index);
+        }
+    }
+
+    template<std::size_t L>
+    void forward_from(Matrix& values, Matrix& next) const {
+        if constexpr (L < sizeof...(Layers)) {
+            std::get<L>(layers_).forward_pass(values, next);
+            std::swap(values, next);
+            forward_from<L + 1>(values, next);
+        }
+    }
+};
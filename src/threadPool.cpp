@@ -0,0 +1,80 @@
+#include "threadPool.hpp"
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = default_thread_count();
+    }
+    for (std::size_t i = 1; i < thread_count; i++) {
+        workers_.emplace_back([this]{ worker_loop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        auto lock = std::lock_guard(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker: workers_) {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::size() const {
+    return workers_.size() + 1;
+}
+
+std::size_t ThreadPool::default_thread_count() {
+    auto count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+void ThreadPool::parallel_for(std::size_t task_count, TaskRef const& task) {
+    if (task_count == 0) return;
+    if (workers_.empty() || task_count == 1) {
+        for (std::size_t i = 0; i < task_count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        auto lock = std::lock_guard(mutex_);
+        task_ = &task;
+        task_count_ = task_count;
+        next_task_ = 0;
+        busy_workers_ = workers_.size();
+        generation_++;
+    }
+    wake_.notify_all();
+    run_tasks();
+
+    auto lock = std::unique_lock(mutex_);
+    done_.wait(lock, [this]{ return busy_workers_ == 0; });
+    task_ = nullptr;
+}
+
+void ThreadPool::run_tasks() {
+    for (auto i = next_task_++; i < task_count_; i = next_task_++) {
+        (*task_)(i);
+    }
+}
+
+void ThreadPool::worker_loop() {
+    std::size_t seen_generation = 0;
+    while (true) {
+        {
+            auto lock = std::unique_lock(mutex_);
+            wake_.wait(lock, [&]{ return stopping_ || generation_ != seen_generation; });
+            if (stopping_) return;
+            seen_generation = generation_;
+        }
+
+        run_tasks();
+
+        auto lock = std::lock_guard(mutex_);
+        if (--busy_workers_ == 0) {
+            done_.notify_one();
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Non-owning reference to a task: unlike std::function it never allocates,
+// whatever the callable captures. It must not outlive that callable, which
+// holds for the argument of a (blocking) parallel_for.
+class TaskRef {
+public:
+    template<typename Task>
+    TaskRef(Task const& task):
+        task_(&task),
+        call_([](void const* task, std::size_t i) { (*static_cast<Task const*>(task))(i); }) {}
+
+    void operator()(std::size_t i) const { call_(task_, i); }
+
+private:
+    void const* task_;
+    void (*call_)(void const*, std::size_t);
+};
+
+// Fixed set of worker threads that run indexed tasks. The calling thread
+// takes part in every parallel_for, so a pool of size 1 spawns no threads.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t thread_count);
+    ~ThreadPool();
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    std::size_t size() const;
+    // Calls task(i) for every i in [0, task_count) and blocks until all finished.
+    void parallel_for(std::size_t task_count, TaskRef const& task);
+
+    static std::size_t default_thread_count();
+
+private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    TaskRef const* task_ = nullptr;
+    std::size_t task_count_ = 0;
+    std::atomic<std::size_t> next_task_{0};
+    std::size_t busy_workers_ = 0;
+    std::size_t generation_ = 0;
+    bool stopping_ = false;
+
+    void worker_loop();
+    void run_tasks();
+};
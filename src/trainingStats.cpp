@@ -0,0 +1,118 @@
+#include "trainingStats.hpp"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+
+char const* train_phase_name(TrainPhase phase) {
+    switch (phase) {
+        case TrainPhase::Load: return "load";
+        case TrainPhase::Forward: return "forward";
+        case TrainPhase::Backward: return "backward";
+        case TrainPhase::Update: return "update";
+        case TrainPhase::Reset: return "reset";
+        case TrainPhase::Checkpoint: return "checkpoint";
+    }
+    return "unknown";
+}
+
+static double to_seconds(TrainingStats::Clock::duration elapsed) {
+    return std::chrono::duration<double>(elapsed).count();
+}
+
+void TrainingStats::begin(std::size_t threads, std::size_t batch_size) {
+    *this = TrainingStats{};
+    threads_ = threads;
+    batch_size_ = batch_size;
+    running_ = true;
+    started_ = Clock::now();
+}
+
+void TrainingStats::end() {
+    if (!running_) return;
+    wall_ = Clock::now() - started_;
+    peak_rss_ = peak_rss_bytes();
+    running_ = false;
+}
+
+void TrainingStats::add(TrainPhase phase, Clock::duration elapsed) {
+    auto index = static_cast<std::size_t>(phase);
+    phase_time_[index] += elapsed;
+    phase_calls_[index]++;
+}
+
+void TrainingStats::count_step(std::size_t images, bool sparse) {
+    iterations_++;
+    images_ += images;
+    sparse_steps_ += sparse;
+}
+
+double TrainingStats::wall_seconds() const {
+    return to_seconds(running_ ? Clock::now() - started_ : wall_);
+}
+
+double TrainingStats::phase_seconds(TrainPhase phase) const {
+    return to_seconds(phase_time_[static_cast<std::size_t>(phase)]);
+}
+
+std::size_t TrainingStats::peak_rss() const {
+    return running_ ? peak_rss_bytes() : peak_rss_;
+}
+
+double TrainingStats::images_per_second() const {
+    auto seconds = wall_seconds();
+    return seconds > 0.0 ? images_ / seconds : 0.0;
+}
+
+std::size_t TrainingStats::peak_rss_bytes() {
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    // Linux reports kilobytes.
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+std::string TrainingStats::summary() const {
+    auto out = std::ostringstream();
+    auto wall = wall_seconds();
+    out << std::fixed << std::setprecision(1)
+        << iterations_ << " steps, " << images_ << " images in " << wall << " s ("
+        << images_per_second() << " img/s), peak RSS " << peak_rss() / 1e6 << " MB\n";
+    for (std::size_t p = 0; p < TRAIN_PHASE_COUNT; p++) {
+        auto phase = static_cast<TrainPhase>(p);
+        auto seconds = phase_seconds(phase);
+        out << "  " << std::left << std::setw(11) << train_phase_name(phase) << std::right
+            << std::setw(9) << seconds * 1e3 << " ms " << std::setw(5) << (wall > 0.0 ? 100.0 * seconds / wall : 0.0) << "%\n";
+    }
+    return out.str();
+}
+
+void TrainingStats::write_json(std::string const& path) const {
+    auto file = std::ofstream(path, std::ios::out | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Unable to write " << path << '\n';
+        exit(1);
+    }
+
+    auto wall = wall_seconds();
+    file << std::setprecision(9)
+        << "{\n"
+        << "  \"iterations\": " << iterations_ << ",\n"
+        << "  \"images\": " << images_ << ",\n"
+        << "  \"sparse_steps\": " << sparse_steps_ << ",\n"
+        << "  \"threads\": " << threads_ << ",\n"
+        << "  \"batch_size\": " << batch_size_ << ",\n"
+        << "  \"wall_seconds\": " << wall << ",\n"
+        << "  \"images_per_second\": " << images_per_second() << ",\n"
+        << "  \"peak_rss_bytes\": " << peak_rss() << ",\n"
+        << "  \"phases\": {\n";
+    for (std::size_t p = 0; p < TRAIN_PHASE_COUNT; p++) {
+        auto phase = static_cast<TrainPhase>(p);
+        auto seconds = phase_seconds(phase);
+        file << "    \"" << train_phase_name(phase) << "\": {\"seconds\": " << seconds
+            << ", \"calls\": " << phase_calls_[p]
+            << ", \"share\": " << (wall > 0.0 ? seconds / wall : 0.0) << '}'
+            << (p + 1 < TRAIN_PHASE_COUNT ? ",\n" : "\n");
+    }
+    file << "  }\n}\n";
+}
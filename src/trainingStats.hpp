@@ -0,0 +1,71 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Where a training step spends its time. Phases are timed on the thread that
+// drives learn(), so a parallel phase counts its wall time once.
+enum class TrainPhase {
+    Load,       // batch assembly (and waiting on a BatchStream)
+    Forward,    // forward pass and loss
+    Backward,   // deltas, backprop and gradient reduction
+    Update,     // weight updates
+    Reset,      // clearing per-step gradient state
+    Checkpoint, // copying the weights for the background checkpoint writer
+};
+
+constexpr std::size_t TRAIN_PHASE_COUNT = 6;
+
+char const* train_phase_name(TrainPhase phase);
+
+class TrainingStats {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    class ScopedTimer {
+    public:
+        ScopedTimer(TrainingStats& stats, TrainPhase phase): stats_(stats), phase_(phase), start_(Clock::now()) {}
+        ~ScopedTimer() { stats_.add(phase_, Clock::now() - start_); }
+        ScopedTimer(ScopedTimer const&) = delete;
+        ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+    private:
+        TrainingStats& stats_;
+        TrainPhase phase_;
+        Clock::time_point start_;
+    };
+
+    // Clears the counters and starts the wall clock of a learn() call.
+    void begin(std::size_t threads, std::size_t batch_size);
+    void end();
+
+    ScopedTimer time(TrainPhase phase) { return {*this, phase}; }
+    void add(TrainPhase phase, Clock::duration elapsed);
+    void count_step(std::size_t images, bool sparse);
+
+    std::size_t iterations() const { return iterations_; }
+    std::size_t images() const { return images_; }
+    double wall_seconds() const;
+    double phase_seconds(TrainPhase phase) const;
+    double images_per_second() const;
+    // Peak resident set size of the process when training ended (or now).
+    std::size_t peak_rss() const;
+    static std::size_t peak_rss_bytes();
+
+    std::string summary() const;
+    void write_json(std::string const& path) const;
+
+private:
+    std::array<Clock::duration, TRAIN_PHASE_COUNT> phase_time_{};
+    std::array<std::size_t, TRAIN_PHASE_COUNT> phase_calls_{};
+    Clock::time_point started_;
+    Clock::duration wall_{};
+    std::size_t peak_rss_ = 0;
+    bool running_ = false;
+    std::size_t iterations_ = 0;
+    std::size_t images_ = 0;
+    std::size_t sparse_steps_ = 0;
+    std::size_t threads_ = 0;
+    std::size_t batch_size_ = 0;
+};
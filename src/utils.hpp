@@ -1,63 +1,85 @@
 #pragma once
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <string>
 #include <vector>
 #include <fstream>
+#include "kernels.hpp"
+#include "packedImage.hpp"
+#include "preprocess.hpp"
 
 inline void displayProgressBar(unsigned int progress, unsigned int total, unsigned int width = 50) {
     float percentage = static_cast<float>(progress) / total;
     unsigned int barWidth = percentage * width;
 
-    std::cout << "[";
-    for (unsigned int i = 0; i < width; i++) {
-        std::cout << (i < barWidth ? "=" : " ");
-    }
-
-    std::cout << "] " << std::fixed << std::setprecision(1) << percentage * 100.0 << "%\r";
+    auto filled = std::min(barWidth, width);
+    auto bar = std::string(filled, '=') + std::string(width - filled, ' ');
+    std::cout << "[" << bar << "] " << std::fixed << std::setprecision(1) << percentage * 100.0 << "%\r";
     std::cout.flush();
 }
 
+// Draws the bar at most once per `interval`; the final step is always drawn.
+class ProgressBar {
+public:
+    explicit ProgressBar(unsigned int total, std::chrono::milliseconds interval = std::chrono::milliseconds(100)):
+        total_(total), interval_(interval) {}
 
-inline void save_to_ppm(std::string const& filename, std::vector<std::vector<float>> const& image) {
-    auto ppm_file = std::ofstream(filename, std::ios::out | std::ios::binary);
-
-    if (!ppm_file.is_open()) {
-        std::cerr << "Unable to open file for writing" << std::endl;
-        exit(1);
+    void update(unsigned int progress) {
+        auto now = std::chrono::steady_clock::now();
+        if (progress < total_ && drawn_ && now - last_draw_ < interval_) return;
+        drawn_ = true;
+        last_draw_ = now;
+        displayProgressBar(progress, total_);
     }
 
-    const int width = static_cast<int>(image[0].size());
-    const int height = static_cast<int>(image.size());
+private:
+    unsigned int total_;
+    std::chrono::steady_clock::duration interval_;
+    std::chrono::steady_clock::time_point last_draw_;
+    bool drawn_ = false;
+};
 
-    ppm_file << "P1\n" << width << " " << height << "\n";
 
-    for (const auto& row : image) {
-        for (bool pixel : row) {
-            ppm_file << pixel << ' ';
+// Writes a binary (P4) bitmap, set pixels black. The file is assembled in
+// memory and written with a single call, so it is safe to call from several
+// threads for different files.
+inline void save_to_pbm(std::string const& filename, PackedImage const& image, std::size_t width) {
+    auto height = image.size() / width;
+    auto row_bytes = (width + 7) / 8;
+    auto header = "P4\n" + std::to_string(width) + " " + std::to_string(height) + "\n";
+    auto buffer = std::string(header.size() + row_bytes * height, '\0');
+    std::copy(header.begin(), header.end(), buffer.begin());
+    auto* bits = reinterpret_cast<unsigned char*>(buffer.data() + header.size());
+
+    auto set_pixel = [&](std::size_t i) {
+        auto x = i % width;
+        bits[(i / width) * row_bytes + x / 8] |= static_cast<unsigned char>(0x80u >> (x % 8));
+    };
+    if (image.format() == PixelFormat::Bit) {
+        thread_local std::vector<std::uint32_t> active;
+        active.clear();
+        image.append_active(active);
+        for (auto i: active) set_pixel(i);
+    } else {
+        for (std::size_t i = 0; i < width * height; i++) {
+            if (image[i] != 0.0f) set_pixel(i);
         }
-       ppm_file.put('\n');
     }
-}
 
-template<std::size_t RowLength, typename T>
-inline std::vector<std::vector<T>> unflatten_image(std::vector<T> image) {
-    std::vector<std::vector<T>> result;
-    std::vector<T> last_subvec;
-
-    for (std::size_t i = 0; i < image.size(); i++) {
-        if (i % RowLength == 0) {
-            if (i != 0) result.push_back(last_subvec);
-            last_subvec = {};
-        } 
-        last_subvec.push_back(image[i]);
+    auto file = std::ofstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Unable to open " << filename << " for writing" << std::endl;
+        exit(1);
     }
-    result.push_back(last_subvec);
-    return result;
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
 }
 
 enum class RunMode {
     Learn,
     Load,
+    Predict,
 };
 
 struct GlobalConfig {
@@ -65,6 +87,18 @@ struct GlobalConfig {
     std::size_t image_count_per_category;
     std::vector<std::string> categories;   
     float learn_rate;
+    std::size_t batch_size;
+    std::size_t threads;
+    bool stream_dataset;    // train from a BatchStream instead of loading every image up front
     RunMode mode;
     std::string result_dirname;
+    std::string predict_dirname;    // CSV files classified in RunMode::Predict
+    bool int8_inference;            // RunMode::Predict uses the quantized model instead of fp32 (opt-in)
+    kernels::WeightFormat weight_format;    // storage of newly created layers; fp32 master kept while training
+    kernels::UpdateRule optimizer;          // learn_rate is the optimizer's step size
+    std::size_t checkpoint_interval;        // iterations between background checkpoints, 0 = never
+    double checkpoint_seconds;              // seconds between background checkpoints, 0 = never
+    bool fast_sigmoid;                      // output layer uses the vectorized sigmoid approximation
+    Preprocessing preprocessing;            // applied to every image as it is loaded; sets the input size
+    bool convolutional;                     // convolution and pooling layers in front of the dense ones
 };